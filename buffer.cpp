@@ -1,16 +1,100 @@
 #include "med.h"
 
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
 #include <fstream>
 #include <filesystem>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 extern void error(std::string_view txt);
+extern Compression detect_compression(const std::string& filename);
+extern int start_decompress(Compression compression, const std::string& filename, int& pid);
+extern bool finish_process(int pid);
+extern Syntax detect_syntax(const std::string& filename);
+extern bool write_text(const std::string& filename, Compression compression,
+                       std::string_view text, std::atomic<long>& written);
+extern unsigned char lex_line(Syntax syntax, std::string_view line, unsigned char state, unsigned char* colors);
+extern std::vector<LexPoint> lex_points(Syntax syntax, std::string_view line, unsigned char state, long interval);
+extern long find_word_end(std::string_view str, long index);
+extern long find_word_start(std::string_view str, long index);
+extern long count_word_starts(std::string_view str, long from, long to);
+extern long count_chars(std::string_view str, long from, long to);
+extern bool is_binary_file(const std::string& filename);
+extern void sort_lines(std::vector<std::string_view>& lines);
+extern void unique_lines(std::vector<std::string_view>& lines);
+extern void filter_lines(std::vector<std::string_view>& lines, std::string_view pattern, bool keep);
 
 #ifdef MED_UTF8
-extern int utf8_length_chars(std::string_view str, int index, int end);
-extern int utf8_length_bytes(std::string_view str, int index, int chars);
-extern int utf8_length_bytes_reverse(std::string_view str, int index, int chars);
+extern int utf8_length_bytes(std::string_view str, long index, int chars);
+extern int utf8_length_bytes_reverse(std::string_view str, long index, int chars);
+extern int utf8_char_width(std::string_view str, long index, long end, int& len);
 #endif
 
+extern PromptType show_prompt;
+extern std::string message;
+
+// Lines longer than this are split into chunks
+// to make locating columns fast
+constexpr int line_chunk_size = 4096;
+
+// Wrapped rows are forgotten when more lines than this have been
+// wrapped, so scrolling through a large file does not keep them all
+constexpr std::size_t max_wrapped_lines = 4096;
+
+// Display width of the character at index when it is drawn
+// at given column, its length in bytes is stored in len
+int char_width(std::string_view str, long index, long end, int col, int& len)
+{
+    unsigned char c = str[index];
+    len = 1;
+
+    // Fast path for printable ASCII
+    if (c >= 32 && c < 127) {
+        return 1;
+    }
+
+    if (c == '\t') {
+        return tab_size - (col % tab_size);
+    }
+
+    // Control characters are drawn as ^X
+    if (c < 32 || c == 127) {
+        return 2;
+    }
+
+#ifdef MED_UTF8
+    return utf8_char_width(str, index, end, len);
+#else
+    (void) end;
+    return 1;
+#endif
+}
+
+// Sum widths of characters from index until end. Stops before
+// a character that would extend past max_col. Returns the index
+// where it stopped and stores the column in col.
+long advance_cols(std::string_view str, long index, long end, int& col, int max_col)
+{
+    while (index < end) {
+        int len;
+        int width = char_width(str, index, end, col, len);
+
+        if (col + width > max_col) {
+            break;
+        }
+
+        col += width;
+        index += len;
+    }
+
+    return index;
+}
+
 // ---------------
 // Private methods
 // ---------------
@@ -19,23 +103,542 @@ extern int utf8_length_bytes_reverse(std::string_view str, int index, int chars)
 // Must be called always after content changes!
 void Buffer::update_line_indices()
 {
-    line_indices.clear();
+    apply_logged_edits();
+    doc->version++;
+    doc->line_indices.clear();
+    doc->line_chunks.clear();
+    doc->lex_points.clear();
+    wrap_rows.clear();
+
+    doc->line_indices.push_back(0);
+
+    for (long i = 0; i < static_cast<long>(doc->content.size()); i++) {
+        if (doc->content[i] == '\n') {
+            doc->line_indices.push_back(i + 1);
+        }
+    }
+
+    doc->line_states.assign(num_of_lines(), 0);
+    doc->states_known = 1;
+    doc->dirty_line = 0;
+
+    doc->word_count = count_word_starts(doc->content, 0, doc->content.size());
+    doc->char_count = count_chars(doc->content, 0, doc->content.size());
+
+    log_edit({ -1, 0, 0, 0, 0, 0 });
+}
+
+// Add lines of content after index from to existing indexes.
+// Used when text was appended to the end of content, the caller
+// calls uncount_text(from, 0) before the text grows.
+void Buffer::extend_line_indices(long from)
+{
+    apply_logged_edits();
+    doc->version++;
+
+    int last_line = num_of_lines() - 1;
+    long appended = from;
+
+    // Last line grows so its chunks are no longer valid
+    doc->line_chunks.erase(num_of_lines() - 1);
+    doc->lex_points.erase(num_of_lines() - 1);
+    wrap_rows.erase(num_of_lines() - 1);
+
+    const char* data = doc->content.data();
+    long end = static_cast<long>(doc->content.size());
+
+    count_text(from, end - from);
+
+    while (from < end) {
+        auto found = static_cast<const char*>(memchr(data + from, '\n', end - from));
+
+        if (!found) {
+            break;
+        }
+
+        from = found - data + 1;
+        doc->line_indices.push_back(from);
+    }
+
+    doc->line_states.resize(num_of_lines(), 0);
+
+    log_edit({ appended, 0, end - appended, last_line, 0, num_of_lines() - 1 - last_line });
+}
+
+// Update indexes of lines after replacing old_len bytes at
+// index with new_len bytes. Lines before the change are kept,
+// lines after are shifted and only the new text is scanned.
+void Buffer::replace_line_indices(long index, long old_len, long new_len)
+{
+    apply_logged_edits();
+
+    long delta = new_len - old_len;
+    int line = line_of(index);
+
+    doc->version++;
+
+    // Lines that start inside the replaced text
+    auto first = std::upper_bound(doc->line_indices.begin(), doc->line_indices.end(), index);
+    auto last = std::upper_bound(first, doc->line_indices.end(), index + old_len);
+
+    for (auto it = last; it != doc->line_indices.end(); it++) {
+        *it += delta;
+    }
+
+    std::vector<long> added;
+    const char* data = doc->content.data();
+
+    for (long i = index; i < index + new_len; ) {
+        auto found = static_cast<const char*>(memchr(data + i, '\n', index + new_len - i));
+
+        if (!found) {
+            break;
+        }
+
+        i = found - data + 1;
+        added.push_back(i);
+    }
+
+    int removed = last - first;
+    int shift = static_cast<int>(added.size()) - removed;
+
+    first = doc->line_indices.erase(first, last);
+    doc->line_indices.insert(first, added.begin(), added.end());
+
+    // Chunks are stored by line number which may have changed
+    doc->line_chunks.clear();
+    doc->lex_points.clear();
+    shift_wrap_rows(line, removed, added.size(), delta);
+
+    // Keep lexer states aligned with lines that did not change
+    doc->line_states.erase(doc->line_states.begin() + line + 1, doc->line_states.begin() + line + 1 + removed);
+    doc->line_states.insert(doc->line_states.begin() + line + 1, added.size(), 0);
+
+    // Line number after the change for a line number before it
+    auto map_line = [&](int old) {
+        if (old <= line) {
+            return old;
+        } else if (old > line + removed) {
+            return old + shift;
+        }
+        return line + static_cast<int>(added.size());
+    };
+
+    doc->states_known = map_line(doc->states_known);
+
+    // Lines of the new text must be lexed again, and the state at the
+    // start of next line may change because the edited line changed
+    int until = line + static_cast<int>(added.size());
+
+    if (doc->dirty_line) {
+        doc->dirty_line = std::min(map_line(doc->dirty_line), line + 1);
+        doc->dirty_until = std::max(map_line(doc->dirty_until), until);
+    } else {
+        doc->dirty_line = line + 1;
+        doc->dirty_until = until;
+    }
+
+    log_edit({ index, old_len, new_len, line, removed, static_cast<int>(added.size()) });
+}
+
+// Lex lines until the states of lines up to upto are known.
+// After an edit, lines are lexed from the first changed line
+// until the state at start of a line is the same as before.
+void Buffer::update_line_states(int upto) const
+{
+    upto = std::min(upto, num_of_lines() - 1);
+
+    auto lex = [this](int line) {
+        auto start = doc->line_indices[line];
+        auto text = std::string_view(doc->content).substr(start, line_end(line) - start);
+        return lex_line(doc->syntax, text, doc->line_states[line], nullptr);
+    };
+
+    if (doc->dirty_line) {
+        while (doc->dirty_line <= upto && doc->dirty_line < doc->states_known) {
+            auto state = lex(doc->dirty_line - 1);
+            bool converged = doc->dirty_line > doc->dirty_until && state == doc->line_states[doc->dirty_line];
+
+            doc->line_states[doc->dirty_line] = state;
+
+            if (converged) {
+                doc->dirty_line = 0;
+                break;
+            }
+
+            doc->dirty_line++;
+        }
+
+        if (doc->dirty_line && doc->dirty_line >= doc->states_known) {
+            doc->states_known = doc->dirty_line;
+            doc->dirty_line = 0;
+        }
+    }
+
+    while (doc->states_known <= upto) {
+        doc->line_states[doc->states_known] = lex(doc->states_known - 1);
+        doc->states_known++;
+    }
+}
+
+// Word and character counts are kept up to date by removing the
+// counts of the changed text before an edit and adding them back
+// after it. A word start depends on the byte before it, and a byte
+// of a multibyte character depends on the whole character, so word
+// starts are counted a few bytes around the text too.
+constexpr long word_context = 4;
+
+void Buffer::uncount_text(long index, long len)
+{
+    long start = std::max(index - word_context, 0L);
+    long end = std::min(index + len + word_context, static_cast<long>(doc->content.size()));
+
+    doc->word_count -= count_word_starts(doc->content, start, end);
+    doc->char_count -= count_chars(doc->content, index, index + len);
+}
+
+void Buffer::count_text(long index, long len)
+{
+    long start = std::max(index - word_context, 0L);
+    long end = std::min(index + len + word_context, static_cast<long>(doc->content.size()));
+
+    doc->word_count += count_word_starts(doc->content, start, end);
+    doc->char_count += count_chars(doc->content, index, index + len);
+}
+
+// Return the line that contains index
+int Buffer::line_of(long index) const
+{
+    auto it = std::upper_bound(doc->line_indices.begin(), doc->line_indices.end(), index);
+    return static_cast<int>(it - doc->line_indices.begin()) - 1;
+}
+
+// Return the chunks of given line, building them on first use.
+// First chunk is the start of line and last chunk is the end.
+const std::vector<Buffer::LineChunk>& Buffer::chunks_of_line(int line) const
+{
+    auto found = doc->line_chunks.find(line);
+
+    if (found != doc->line_chunks.end()) {
+        return found->second;
+    }
+
+    auto& chunks = doc->line_chunks[line];
+    long index = line_start(line);
+    long end = line_end(line);
+    int col = 0;
+
+    chunks.push_back({ index, col });
+
+    while (index < end) {
+        long next = std::min(index + line_chunk_size, end);
+
+        // Characters are not split between chunks because
+        // we only stop at the start of one
+        index = advance_cols(doc->content, index, next, col, INT_MAX);
+        chunks.push_back({ index, col });
+    }
+
+    return chunks;
+}
+
+// Return the points where lexing can resume in given line,
+// finding them on first use. Short lines have none.
+const std::vector<LexPoint>& Buffer::lex_points_of_line(int line) const
+{
+    auto found = doc->lex_points.find(line);
+
+    if (found != doc->lex_points.end()) {
+        return found->second;
+    }
+
+    auto text = std::string_view(doc->content).substr(line_start(line), line_end(line) - line_start(line));
+    auto& points = doc->lex_points[line];
+
+    if (static_cast<long>(text.size()) > line_chunk_size) {
+        points = lex_points(doc->syntax, text, line_state(line), line_chunk_size);
+    }
+
+    return points;
+}
+
+// Row of the screen that shows line from index on. Lexing starts
+// from the last point before index, so drawing the end of a long
+// line lexes about one chunk of it.
+ScreenRow Buffer::screen_row(int line, long index, int col, int first_col) const
+{
+    long start = line_start(line);
+    ScreenRow row = { line, start, line_end(line), index, col, first_col, start, 0 };
+
+    if (doc->syntax == Syntax::none) {
+        return row;
+    }
+
+    row.state = line_state(line);
+
+    if (index - start >= line_chunk_size) {
+        const auto& points = lex_points_of_line(line);
+        auto it = std::upper_bound(points.begin(), points.end(), index - start, [](long offset, const LexPoint& point) {
+            return offset < point.offset;
+        });
+
+        if (it != points.begin()) {
+            it--;
+            row.lex_start = start + it->offset;
+            row.state = it->state;
+        }
+    }
+
+    return row;
+}
+
+// Return the wrapped rows of given line, finding them on first use.
+// Each row starts where the previous row ran out of screen width.
+// A line that fills its last row exactly gets an empty row after it
+// so that the end of the line has somewhere to show the cursor.
+const std::vector<Buffer::LineChunk>& Buffer::rows_of_line(int line) const
+{
+    auto found = wrap_rows.find(line);
+
+    if (found != wrap_rows.end()) {
+        return found->second;
+    }
+
+    if (wrap_rows.size() >= max_wrapped_lines) {
+        wrap_rows.clear();
+    }
+
+    auto& rows = wrap_rows[line];
+    long index = line_start(line);
+    long end = line_end(line);
+    int width = std::max(1, screen_width);
+    int col = 0;
+
+    rows.push_back({ index, col });
+
+    while (index < end) {
+        int row_col = col;
+        long next = advance_cols(doc->content, index, end, col, row_col + width);
+
+        // Character wider than the screen gets a row of its own
+        if (next == index) {
+            int len;
+            col += char_width(doc->content, index, end, col, len);
+            next = index + len;
+        }
+
+        index = next;
+
+        if (index < end || col - row_col >= width) {
+            rows.push_back({ index, col });
+        }
+    }
+
+    return rows;
+}
+
+// Rows of the lines after an edit move with their lines, the
+// edited lines are wrapped again when they are shown
+void Buffer::shift_wrap_rows(int line, int removed, int added, long delta)
+{
+    if (wrap_rows.empty()) {
+        return;
+    }
+
+    std::unordered_map<int, std::vector<LineChunk>> shifted;
+
+    for (auto& [number, rows] : wrap_rows) {
+        if (number < line) {
+            shifted.emplace(number, std::move(rows));
+        } else if (number > line + removed) {
+            for (auto& row : rows) {
+                row.index += delta;
+            }
+
+            shifted.emplace(number + added - removed, std::move(rows));
+        }
+    }
+
+    wrap_rows.swap(shifted);
+}
+
+// Visual rows: with soft wrap, moving and scrolling go by rows
+// on the screen. Only the rows of lines between the old and new
+// position are looked at.
+
+Buffer::VisualRow Buffer::point_row() const
+{
+    int line = current_line();
+    const auto& rows = rows_of_line(line);
+
+    auto it = std::upper_bound(rows.begin(), rows.end(), point,
+        [](long i, const LineChunk& row) { return i < row.index; });
+
+    return { line, static_cast<int>(it - rows.begin()) - 1 };
+}
+
+// Row at the top of the screen. An edit may have
+// left the line with fewer rows than before.
+Buffer::VisualRow Buffer::top_row() const
+{
+    int line = std::min(offset_line, num_of_lines() - 1);
+    int last = static_cast<int>(rows_of_line(line).size()) - 1;
+
+    return { line, std::min(offset_row, last) };
+}
+
+// Row that is delta rows after pos, or before it if delta is
+// negative. Stops at the first and last row of the buffer.
+Buffer::VisualRow Buffer::move_rows(VisualRow pos, long delta) const
+{
+    while (delta > 0) {
+        int last = static_cast<int>(rows_of_line(pos.line).size()) - 1;
+
+        if (pos.row + delta <= last) {
+            pos.row += delta;
+            break;
+        } else if (pos.line == num_of_lines() - 1) {
+            pos.row = last;
+            break;
+        }
+
+        delta -= last - pos.row + 1;
+        pos = { pos.line + 1, 0 };
+    }
+
+    while (delta < 0) {
+        if (pos.row + delta >= 0) {
+            pos.row += delta;
+            break;
+        } else if (pos.line == 0) {
+            pos.row = 0;
+            break;
+        }
+
+        delta += pos.row + 1;
+        pos = { pos.line - 1, static_cast<int>(rows_of_line(pos.line - 1).size()) - 1 };
+    }
+
+    return pos;
+}
+
+// Column of point from the start of its row
+int Buffer::row_col() const
+{
+    auto pos = point_row();
+    return current_virtual_col() - rows_of_line(pos.line)[pos.row].col;
+}
+
+// Move point to the goal column of given row, but not past
+// the last character of the row
+void Buffer::set_row(VisualRow pos, bool reconcile)
+{
+    const auto& rows = rows_of_line(pos.line);
+    const auto& row = rows[pos.row];
+
+    long end = line_end(pos.line);
+    int max_col = row.col + goal_col;
+
+    if (pos.row + 1 < static_cast<int>(rows.size())) {
+        end = rows[pos.row + 1].index;
+        max_col = std::min(max_col, rows[pos.row + 1].col - 1);
+    }
+
+    int col = row.col;
+    set_point(advance_cols(doc->content, row.index, end, col, max_col), reconcile, false);
+}
+
+// Scroll by delta rows and keep point on the screen
+void Buffer::scroll_rows(long delta)
+{
+    auto top = move_rows(top_row(), delta);
+
+    offset_line = top.line;
+    offset_row = top.row;
+
+    reconcile_by_moving_point();
+}
+
+// Edit primitives
+
+void Buffer::insert_text(long index, std::string_view txt)
+{
+    start_journal(false);
+    doc->journal->record_insert(index, txt);
+    before_change();
+    uncount_text(index, 0);
+
+    doc->content.insert(index, txt);
+    doc->content_changed = true;
+    replace_line_indices(index, 0, txt.size());
+    count_text(index, txt.size());
+}
+
+void Buffer::erase_text(long index, long len)
+{
+    start_journal(false);
+    doc->journal->record_erase(index, len);
+    before_change();
+    uncount_text(index, len);
+
+    doc->content.erase(index, len);
+    doc->content_changed = true;
+    replace_line_indices(index, len, 0);
+    count_text(index, 0);
+}
+
+// Threads that read content must not see it change: the counter is
+// stopped and a save in progress keeps the old content for itself.
+// The buffer goes on with the copy that the saver made.
+void Buffer::before_change()
+{
+    doc->counter.reset();
+
+    if (doc->saver && !doc->saver->keeps_content()) {
+        if (doc->saver->is_done()) {
+            // A copy may still be read from content
+            doc->saver->wait();
+        } else {
+            auto copy = doc->saver->take_copy();
+            doc->saver->keep(std::move(doc->content));
+            doc->content = std::move(copy);
+        }
+    }
+}
+
+// Edits during a save wait until the saver has copied the text,
+// so that the copy is not made while the screen is frozen
+bool Buffer::can_edit()
+{
+    if (!doc->saver || doc->saver->keeps_content() || doc->saver->is_done()) {
+        return true;
+    }
 
-    line_indices.push_back(0);
+    doc->saver->start_copy();
+    return doc->saver->copy_ready();
+}
 
-    for (int i = 0; i < static_cast<int>(content.size()); i++) {
-        if (content[i] == '\n') {
-            line_indices.push_back(i + 1);
+void Buffer::start_journal(bool resume)
+{
+    if (!doc->journal) {
+        doc->journal = std::make_unique<Journal>();
+
+        // During a save the journal is opened when the new file
+        // is complete, until then records are kept in memory.
+        // Editing works without a journal if it cannot be opened,
+        // then nothing is recorded.
+        if (!doc->saver) {
+            doc->journal->open(filename, resume);
         }
     }
 }
 
 // Setters that call reconcialition as needed
 
-void Buffer::set_point(int value, bool reconcile, bool set_goal)
+void Buffer::set_point(long value, bool reconcile, bool set_goal)
 {
-    if (value > static_cast<int>(content.length())) {
-        value = content.length();
+    if (value > static_cast<long>(doc->content.length())) {
+        value = doc->content.length();
     }
     if (value < 0) {
         value = 0;
@@ -47,8 +650,9 @@ void Buffer::set_point(int value, bool reconcile, bool set_goal)
         reconcile_by_scrolling();
     }
 
+    // Goal is the column on the row when wrapping
     if (set_goal) {
-        goal_col = current_virtual_col();
+        goal_col = wrap ? row_col() : current_virtual_col();
     }
 }
 
@@ -58,23 +662,7 @@ bool Buffer::set_line(int line, bool reconcile)
         return false;
     }
 
-    int min = line_start(line);
-    int max = line_end(line);
-
-#ifdef MED_UTF8
-    int p = min + utf8_length_bytes(content, min, goal_col);
-#else
-    int p = min + goal_col;
-#endif
-
-    if (p < min) {
-        p = min;
-    }
-    if (p > max) {
-        p = max;
-    }
-
-    set_point(p, reconcile, false);
+    set_point(col_to_index(line, goal_col), reconcile, false);
 
     return true;
 }
@@ -99,13 +687,7 @@ void Buffer::set_offset_line(int value, bool reconcile)
 
 void Buffer::set_offset_col(int value, bool reconcile)
 {
-    int current = current_line();
-
-#ifdef MED_UTF8
-    int max = utf8_length_chars(content, line_start(current), line_end(current)) - 2;
-#else
-    int max = line_end(current) - line_start(current) - 2;
-#endif
+    int max = line_length_cols(current_line()) - 2;
 
     if (value > max) {
         value = max;
@@ -134,26 +716,41 @@ void Buffer::reconcile_by_moving_point()
     int last_buffer_line = screen_height - 3;
     int last_buffer_col = screen_width - 1;
 
+    if (wrap) {
+        auto current = point_row();
+        auto top = top_row();
+        auto bottom = move_rows(top, last_buffer_line);
+
+        if (current < top) {
+            set_row(top, false);
+        } else if (current > bottom) {
+            set_row(bottom, false);
+        }
+
+        return;
+    }
+
     if (current_line() < offset_line) {
         set_line(offset_line, false);
     } else if (current_line() > (offset_line + last_buffer_line)) {
         set_line(offset_line + last_buffer_line, false);
     }
 
-    int start = line_start(current_line());
+    int current = current_line();
 
     if (current_virtual_col() < offset_col) {
-#ifdef MED_UTF8
-        set_point(start + utf8_length_bytes(content, start, offset_col), false, true);
-#else
-        set_point(start + offset_col, false, true);
-#endif
+        long index = col_to_index(current, offset_col);
+
+        // Skip the character if it is partly scrolled out of view
+        if (index < line_end(current) && index_to_col(current, index) < offset_col) {
+            int len;
+            char_width(doc->content, index, line_end(current), 0, len);
+            index += len;
+        }
+
+        set_point(index, false, true);
     } else if (current_virtual_col() > (offset_col + last_buffer_col)) {
-#ifdef MED_UTF8
-        set_point(start + utf8_length_bytes(content, start, offset_col + last_buffer_col), false, true);
-#else
-        set_point(start + offset_col + last_buffer_col, false, true);
-#endif
+        set_point(col_to_index(current, offset_col + last_buffer_col), false, true);
     }
 }
 
@@ -162,16 +759,43 @@ void Buffer::reconcile_by_scrolling()
     int last_buffer_line = screen_height - 3;
     int last_buffer_col = screen_width - 1;
 
+    // Rows between the top and point are counted, at most a screenful
+    if (wrap) {
+        auto current = point_row();
+        auto top = top_row();
+
+        if (current < top) {
+            top = current;
+        } else if (current > move_rows(top, last_buffer_line)) {
+            top = move_rows(current, -last_buffer_line);
+        }
+
+        offset_line = top.line;
+        offset_row = top.row;
+        return;
+    }
+
     if (current_line() < offset_line) {
         set_offset_line(current_line(), false);
     } else if (current_line() > (offset_line + last_buffer_line)) {
         set_offset_line(current_line() - last_buffer_line, false);
     }
 
-    if (current_virtual_col() < offset_col) {
-        set_offset_col(current_virtual_col(), false);
-    } else if (current_virtual_col() > (offset_col + last_buffer_col)) {
-        set_offset_col(current_virtual_col() - last_buffer_col, false);
+    int col = current_virtual_col();
+
+    // Last column of a wide character or tab must be visible too
+    int last_col = col;
+    long end = line_end(current_line());
+
+    if (point < end) {
+        int len;
+        last_col += char_width(doc->content, point, end, col, len) - 1;
+    }
+
+    if (col < offset_col) {
+        set_offset_col(col, false);
+    } else if (last_col > (offset_col + last_buffer_col)) {
+        set_offset_col(last_col - last_buffer_col, false);
     }
 }
 
@@ -182,19 +806,22 @@ constexpr bool is_whitespace(char c)
     return c == ' ' || c == '\t' || c == '\n' || c == '\r';
 }
 
-constexpr bool is_letter_or_digit(char c)
+// Search helpers
+
+long Buffer::word_boundary_forward(long index) const
 {
-    return (c >= '0' && c <= '9') ||
-        (c >= 'a' && c <= 'z') ||
-        (c >= 'A' && c <= 'Z');
+    return find_word_end(doc->content, index);
 }
 
-// Search helpers
+long Buffer::word_boundary_backward(long index) const
+{
+    return find_word_start(doc->content, index);
+}
 
-int Buffer::word_boundary_forward(int index) const
+long Buffer::paragraph_boundary_forward(long index) const
 {
-    for (; index < static_cast<int>(content.length()) - 1; index++) {
-        if (is_letter_or_digit(content[index]) && !is_letter_or_digit(content[index + 1])) {
+    for (; index < static_cast<long>(doc->content.length()) - 1; index++) {
+        if (doc->content[index] == '\n' && doc->content[index + 1] == '\n') {
             return index + 1;
         }
     }
@@ -202,10 +829,10 @@ int Buffer::word_boundary_forward(int index) const
     return -1;
 }
 
-int Buffer::word_boundary_backward(int index) const
+long Buffer::paragraph_boundary_backward(long index) const
 {
     for (; index > 0; index--) {
-        if (is_letter_or_digit(content[index]) && !is_letter_or_digit(content[index - 1])) {
+        if (doc->content[index] == '\n' && doc->content[index - 1] == '\n') {
             return index;
         }
     }
@@ -213,41 +840,181 @@ int Buffer::word_boundary_backward(int index) const
     return -1;
 }
 
-int Buffer::paragraph_boundary_forward(int index) const
-{
-    for (; index < static_cast<int>(content.length()) - 1; index++) {
-        if (content[index] == '\n' && content[index + 1] == '\n') {
-            return index + 1;
-        }
+// --------------
+// Public methods
+// --------------
+
+// Constructor
+Buffer::Buffer(std::string fname, bool hex_mode, bool read_only_mode)
+{
+    filename = fname;
+    read_only = read_only_mode;
+    doc = std::make_shared<Document>();
+    doc->edits_seen.push_back(0);
+    doc->compression = detect_compression(filename);
+    doc->syntax = detect_syntax(filename);
+
+    bool exists = std::filesystem::exists(filename);
+
+    // Binary files are shown in hex and never read into content
+    if (exists && doc->compression == Compression::none && (hex_mode || is_binary_file(filename))) {
+        hex = std::make_unique<HexView>(filename);
+        doc->file_info = stat_file();
+        update_line_indices();
+    } else if (exists && doc->compression == Compression::none && read_only) {
+        // Files that are only viewed are never read into content
+        view = std::make_unique<TextView>(filename, doc->syntax);
+        doc->file_info = stat_file();
+        update_line_indices();
+    } else if (exists) {
+        read_file();
+    } else {
+        update_line_indices();
     }
+}
 
-    return -1;
+// Another buffer of a document that is already open.
+// It starts at the beginning and moves on its own.
+Buffer::Buffer(std::string fname, std::shared_ptr<Document> document)
+{
+    filename = fname;
+    doc = document;
+    doc_view = doc->edits_seen.size();
+    doc->edits_seen.push_back(doc->first_edit + doc->edits.size());
+}
+
+// Shared documents
+
+std::shared_ptr<Document> Buffer::get_document() const
+{
+    return doc;
 }
 
-int Buffer::paragraph_boundary_backward(int index) const
+// Is fname the file of this buffer, under any name? Only
+// buffers that keep the file in content can be shared.
+bool Buffer::is_file(const std::string& fname) const
 {
-    for (; index > 0; index--) {
-        if (content[index] == '\n' && content[index - 1] == '\n') {
-            return index;
-        }
+    if (hex || view) {
+        return false;
     }
 
-    return -1;
+    struct stat st;
+
+    if (stat(fname.c_str(), &st) != 0) {
+        return fname == filename;
+    }
+
+    return st.st_dev == doc->file_info.device && st.st_ino == doc->file_info.inode;
 }
 
-// --------------
-// Public methods
-// --------------
+bool Buffer::shares_document(const Buffer& other) const
+{
+    return doc == other.doc;
+}
 
-// Constructor
-Buffer::Buffer(std::string fname)
+// Edits that every buffer has seen are dropped, and buffers that
+// fall further behind than this are reset instead of catching up
+constexpr std::size_t max_logged_edits = 64 * 1024;
+
+void Buffer::log_edit(Document::Edit edit)
 {
-    filename = fname;
+    if (doc->edits_seen.size() < 2) {
+        return;
+    }
 
-    if (std::filesystem::exists(filename)) {
-        read_file();
-    } else {
-        update_line_indices();
+    if (doc->edits.size() >= max_logged_edits) {
+        doc->first_edit += doc->edits.size();
+        doc->edits.clear();
+    }
+
+    doc->edits.push_back(edit);
+    doc->edits_seen[doc_view] = doc->first_edit + doc->edits.size();
+}
+
+// Keep positions inside content after it was replaced
+void Buffer::clamp_positions()
+{
+    long size = doc->content.size();
+
+    point = std::min(point, size);
+    previous_point = std::min(previous_point, size);
+    mark = std::min(mark, size);
+    offset_line = std::min(offset_line, std::max(0, static_cast<int>(doc->line_indices.size()) - 1));
+    offset_row = 0;
+    wrap_rows.clear();
+}
+
+// Move point, mark and the screen past the edits made through
+// the other buffers of the document. Returns false if there were
+// none. Line indexes may not be updated yet for the last edit.
+bool Buffer::apply_logged_edits()
+{
+    long& seen = doc->edits_seen[doc_view];
+    long end = doc->first_edit + doc->edits.size();
+
+    if (seen == end) {
+        return false;
+    }
+
+    if (seen < doc->first_edit) {
+        clamp_positions();
+        seen = doc->first_edit;
+    }
+
+    auto shift = [](long& pos, const Document::Edit& edit) {
+        if (pos > edit.index && pos >= edit.index + edit.removed) {
+            pos += edit.inserted - edit.removed;
+        } else if (pos > edit.index) {
+            pos = edit.index;
+        }
+    };
+
+    for (; seen < end; seen++) {
+        const auto& edit = doc->edits[seen - doc->first_edit];
+
+        if (edit.index < 0) {
+            clamp_positions();
+            continue;
+        }
+
+        // Following buffers stay at the end when text is appended
+        bool at_end = follow && point == edit.index &&
+            edit.index + edit.inserted == static_cast<long>(doc->content.size());
+
+        shift(point, edit);
+        shift(previous_point, edit);
+
+        if (at_end) {
+            point += edit.inserted;
+        }
+
+        if (mark >= 0) {
+            shift(mark, edit);
+        }
+
+        if (offset_line > edit.line + edit.lines_removed) {
+            offset_line += edit.lines_added - edit.lines_removed;
+        } else if (offset_line > edit.line) {
+            offset_line = edit.line;
+            offset_row = 0;
+        }
+
+        shift_wrap_rows(edit.line, edit.lines_removed, edit.lines_added, edit.inserted - edit.removed);
+    }
+
+    if (std::ranges::min(doc->edits_seen) == end) {
+        doc->first_edit = end;
+        doc->edits.clear();
+    }
+
+    return true;
+}
+
+// Catch up with the other buffers and keep point on the screen
+void Buffer::catch_up()
+{
+    if (apply_logged_edits() && screen_height > 0) {
+        reconcile_by_scrolling();
     }
 }
 
@@ -255,6 +1022,11 @@ Buffer::Buffer(std::string fname)
 
 void Buffer::read_file()
 {
+    if (doc->compression != Compression::none) {
+        start_loading();
+        return;
+    }
+
     // Get the file size
     auto size = std::filesystem::file_size(filename);
 
@@ -262,8 +1034,9 @@ void Buffer::read_file()
     auto file = std::ifstream(filename, std::ios_base::in | std::ios_base::binary);
 
     // Read file contents into memory
-    content.resize(size);
-    file.read(content.data(), size);
+    before_change();
+    doc->content.resize(size);
+    file.read(doc->content.data(), size);
 
     // Make sure the number of bytes read matches the file size
     // https://isocpp.github.io/CppCoreGuidelines/CppCoreGuidelines.html#es49-if-you-must-use-a-cast-use-a-named-cast
@@ -271,113 +1044,902 @@ void Buffer::read_file()
         error("Unable to read file");
     }
 
-    update_line_indices();
+    doc->file_info = stat_file();
+    doc->file_info.size = size;
+    doc->changed_on_disk = false;
+
+    update_line_indices();
+}
+
+// Start writing content into file in the background. Editing can
+// continue while the file is written. Small files are written
+// before returning.
+void Buffer::write_file()
+{
+    if (hex) {
+        auto result = hex->write(filename);
+
+        if (!result.empty()) {
+            error("Unable to write file: " + result);
+        }
+
+        set_saved();
+        return;
+    }
+
+    constexpr long background_size = 1024 * 1024;
+
+    // Do not write a partial file
+    finish_loading();
+    finish_save();
+
+    // Old journal stays on disk until the save is done
+    doc->journal.reset();
+
+    doc->saver = std::make_unique<Saver>(doc->content, filename, doc->compression);
+    doc->saving_version = doc->version;
+
+    if (static_cast<long>(doc->content.size()) < background_size) {
+        finish_save();
+    }
+}
+
+// Finish the save if it is done
+void Buffer::check_save()
+{
+    if (doc->saver && doc->saver->is_done()) {
+        finish_save();
+    }
+}
+
+// Wait for the save to be done and update the state of buffer.
+// A failed save is reported and the changes stay unsaved.
+void Buffer::finish_save()
+{
+    if (!doc->saver) {
+        return;
+    }
+
+    doc->saver->wait();
+    bool ok = doc->saver->succeeded();
+    doc->saver.reset();
+
+    auto info = stat_file();
+    bool file_kept = info == doc->file_info;
+
+    doc->changed_on_disk = false;
+    doc->file_info = info;
+
+    if (!ok) {
+        message = "Unable to write file: " + filename;
+
+        if (show_prompt != PromptType::quit) {
+            show_prompt = PromptType::message;
+        }
+
+        if (file_kept) {
+            // Edits made during the save follow the old records
+            if (doc->journal) {
+                doc->journal->open(filename, true);
+            }
+        } else if (doc->compression == Compression::none) {
+            // File is partly written, so the journal starts
+            // over from it with the whole text
+            doc->journal = std::make_unique<Journal>();
+            doc->journal->record_erase(0, info.size);
+            doc->journal->record_insert(0, doc->content);
+            doc->journal->open(filename, false);
+        } else {
+            // Length of the partly written text is not known
+            discard_journal();
+        }
+
+        return;
+    }
+
+    // Saved changes do not need recovery, but edits
+    // made during the save are journaled for the new file
+    std::filesystem::remove(Journal::path_for(filename));
+
+    if (doc->journal) {
+        doc->journal->open(filename, false);
+    }
+
+    if (doc->version == doc->saving_version) {
+        doc->content_changed = false;
+    }
+}
+
+// Wait until loading and saving are done
+void Buffer::finish_io()
+{
+    finish_loading();
+    finish_save();
+}
+
+// Write content into file and return an error message if it failed.
+// Does not change the buffer, so it may be called from any thread
+// while the buffer is not being changed.
+std::string Buffer::write_content() const
+{
+    if (hex) {
+        return hex->write(filename);
+    }
+
+    std::atomic<long> written = 0;
+    errno = 0;
+
+    if (!write_text(filename, doc->compression, doc->content, written)) {
+        return errno ? strerror(errno) : "Unable to write file";
+    }
+
+    return {};
+}
+
+// Content was written into file by write_content()
+void Buffer::set_saved()
+{
+    if (hex) {
+        hex->clear_changes();
+    }
+
+    doc->content_changed = false;
+    doc->changed_on_disk = false;
+    doc->file_info = stat_file();
+    discard_journal();
+}
+
+// Percentage of file written or -1 when not saving
+int Buffer::save_progress() const
+{
+    if (!doc->saver) {
+        return -1;
+    }
+
+    long size = doc->saver->get_text().size();
+    return size ? doc->saver->get_written() * 100 / size : 0;
+}
+
+// Loading compressed files
+
+// Start decompressing the file. Content is filled in by load_more()
+// as the output becomes available, so the file can be viewed before
+// all of it has been decompressed.
+void Buffer::start_loading()
+{
+    finish_loading();
+    before_change();
+
+    doc->content.clear();
+    update_line_indices();
+
+    doc->load_fd = start_decompress(doc->compression, filename, doc->load_pid);
+
+    if (doc->load_fd < 0) {
+        error("Unable to read file");
+    }
+
+    doc->file_info = stat_file();
+    doc->changed_on_disk = false;
+}
+
+// Read what is available from the decompressor without waiting,
+// and index lines of the new text at the same time
+void Buffer::load_more()
+{
+    if (doc->load_fd < 0) {
+        return;
+    }
+
+    // Limit how much is read at once so the screen gets updated
+    constexpr long max_read = 4 * 1024 * 1024;
+    constexpr long chunk = 256 * 1024;
+
+    long old_length = static_cast<long>(doc->content.size());
+    long length = old_length;
+    bool eof = false;
+
+    before_change();
+    uncount_text(old_length, 0);
+
+    while (length - old_length < max_read) {
+        doc->content.resize(length + chunk);
+        auto n = read(doc->load_fd, doc->content.data() + length, chunk);
+
+        if (n > 0) {
+            length += n;
+        } else {
+            eof = n == 0 || errno != EAGAIN;
+            break;
+        }
+    }
+
+    doc->content.resize(length);
+    extend_line_indices(old_length);
+
+    if (eof) {
+        close(doc->load_fd);
+        doc->load_fd = -1;
+
+        if (!finish_process(doc->load_pid)) {
+            error("Unable to read file");
+        }
+    }
+}
+
+// Read the rest of the file, waiting for the decompressor
+void Buffer::finish_loading()
+{
+    while (doc->load_fd >= 0) {
+        pollfd fds[] = { { doc->load_fd, POLLIN, 0 } };
+        poll(fds, 1, -1);
+        load_more();
+    }
+}
+
+// Loading is driven by the first buffer of the document
+int Buffer::get_load_fd() const
+{
+    return doc_view == 0 ? doc->load_fd : -1;
+}
+
+// Changes on disk
+
+Buffer::FileInfo Buffer::stat_file() const
+{
+    FileInfo info;
+    struct stat st;
+
+    if (stat(filename.c_str(), &st) == 0) {
+        info.device = st.st_dev;
+        info.inode = st.st_ino;
+        info.size = st.st_size;
+        info.mtime = st.st_mtim.tv_sec * 1'000'000'000L + st.st_mtim.tv_nsec;
+    }
+
+    return info;
+}
+
+// Append bytes that were added to the end of the file since it
+// was last read. They are read straight into content and only
+// the new part is scanned for lines.
+void Buffer::read_appended(long size)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+        return;
+    }
+
+    long old_length = static_cast<long>(doc->content.size());
+    long wanted = size - doc->file_info.size;
+    long done = 0;
+
+    before_change();
+    uncount_text(old_length, 0);
+    doc->content.resize(old_length + wanted);
+
+    while (done < wanted) {
+        auto n = pread(fd, doc->content.data() + old_length + done, wanted - done, doc->file_info.size + done);
+
+        if (n <= 0) {
+            break;
+        }
+
+        done += n;
+    }
+
+    close(fd);
+
+    doc->content.resize(old_length + done);
+    doc->file_info = stat_file();
+    doc->file_info.size = size - wanted + done;
+
+    extend_line_indices(old_length);
+}
+
+// Called when the file was changed on disk. When following,
+// new bytes are appended and a truncated or rotated file is read
+// again if there are no unsaved changes. The view keeps following
+// the end if the point was there. Otherwise we only remember the
+// change to warn the user.
+void Buffer::file_changed()
+{
+    // Changes come from our own save
+    if (doc->saver) {
+        return;
+    }
+
+    catch_up();
+
+    auto info = stat_file();
+
+    // View is updated on any change, a mapping must not
+    // be read past the end of a file that was truncated
+    if (view) {
+        if (info.inode == 0 || info == doc->file_info) {
+            return;
+        }
+
+        bool at_end = view->get_point() == static_cast<long>(view->get_text().size());
+        bool appended = info.device == doc->file_info.device && info.inode == doc->file_info.inode &&
+            info.size >= doc->file_info.size;
+
+        doc->counter.reset();
+        doc->version++;
+
+        // File may have been replaced again since stat
+        if (!view->remap(filename, appended)) {
+            doc->changed_on_disk = true;
+            return;
+        }
+
+        doc->file_info = info;
+        doc->changed_on_disk = false;
+
+        if (follow && at_end) {
+            view->end_of_buffer();
+        }
+
+        return;
+    }
+
+    // Mapping must cover the file as it is now, reading
+    // past the end of a truncated file would crash
+    if (hex && info.inode != 0 && (info.size != hex->get_size() ||
+                                   info.inode != doc->file_info.inode ||
+                                   info.device != doc->file_info.device) &&
+        !hex->remap(filename)) {
+        doc->changed_on_disk = true;
+        return;
+    }
+
+    if (!follow || hex) {
+        if (!(info == doc->file_info)) {
+            doc->changed_on_disk = true;
+        }
+
+        return;
+    }
+
+    // File was moved away and not yet replaced
+    if (info.inode == 0) {
+        return;
+    }
+
+    bool at_end = point == static_cast<long>(doc->content.length());
+
+    if (info.device != doc->file_info.device || info.inode != doc->file_info.inode ||
+        info.size < doc->file_info.size) {
+        // Unsaved edits are not thrown away, the user decides
+        if (doc->content_changed) {
+            doc->changed_on_disk = true;
+            return;
+        }
+
+        read_file();
+        discard_journal();
+        doc->content_changed = false;
+    } else if (info.size > doc->file_info.size) {
+        read_appended(info.size);
+
+        // Edits can still be recovered on top of the longer file
+        if (doc->journal) {
+            doc->journal->record_file(filename);
+        }
+    } else {
+        return;
+    }
+
+    if (at_end) {
+        end_of_buffer();
+    } else {
+        set_point(point, true, false);
+    }
+}
+
+// Read the file again after it was changed on disk. Common start
+// and end of the old and new content are found by comparing chunks
+// of the file, and only the differing middle part is read into
+// content and indexed. Point and scroll position are kept when they
+// are in the unchanged parts. Unsaved changes are discarded.
+void Buffer::reload()
+{
+    finish_save();
+
+    if (view) {
+        file_changed();
+        return;
+    }
+
+    // Map the file again, its size may have changed
+    if (hex) {
+        hex->clear_changes();
+        doc->content_changed = false;
+        doc->file_info = stat_file();
+        doc->changed_on_disk = !hex->remap(filename);
+        return;
+    }
+
+    // Compressed files can only be decompressed again from the start
+    if (doc->compression != Compression::none) {
+        read_file();
+        set_point(point, true, false);
+        doc->content_changed = false;
+        discard_journal();
+        return;
+    }
+
+    int fd = open(filename.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+        return;
+    }
+
+    auto info = stat_file();
+    long old_size = static_cast<long>(doc->content.size());
+    long common = std::min(old_size, info.size);
+    std::string chunk(64 * 1024, '\0');
+
+    // Length of unchanged start
+    long prefix = 0;
+
+    while (prefix < common) {
+        auto n = pread(fd, chunk.data(), std::min<long>(chunk.size(), common - prefix), prefix);
+
+        if (n <= 0) {
+            break;
+        }
+
+        auto diff = std::mismatch(chunk.begin(), chunk.begin() + n, doc->content.begin() + prefix);
+        prefix += diff.first - chunk.begin();
+
+        if (diff.first != chunk.begin() + n) {
+            break;
+        }
+    }
+
+    // Length of unchanged end, not overlapping the start
+    long suffix = 0;
+
+    while (suffix < common - prefix) {
+        long len = std::min<long>(chunk.size(), common - prefix - suffix);
+        auto n = pread(fd, chunk.data(), len, info.size - suffix - len);
+
+        if (n != len) {
+            break;
+        }
+
+        auto diff = std::mismatch(chunk.rbegin() + (chunk.size() - len), chunk.rend(),
+                                  doc->content.rbegin() + suffix);
+        suffix += diff.first - (chunk.rbegin() + (chunk.size() - len));
+
+        if (diff.first != chunk.rend()) {
+            break;
+        }
+    }
+
+    // Replace the middle part
+    long old_len = old_size - prefix - suffix;
+    long new_len = info.size - prefix - suffix;
+
+    std::string middle(new_len, '\0');
+    auto n = pread(fd, middle.data(), new_len, prefix);
+
+    close(fd);
+
+    if (n != new_len) {
+        return;
+    }
+
+    long top = line_start(offset_line);
+
+    before_change();
+    uncount_text(prefix, old_len);
+    doc->content.replace(prefix, old_len, middle);
+    replace_line_indices(prefix, old_len, new_len);
+    count_text(prefix, new_len);
+
+    // Positions after the change move with the text,
+    // inside the change they go to its start
+    auto map = [&](long index) {
+        if (index >= prefix + old_len) {
+            return index + new_len - old_len;
+        }
+        return std::min(index, prefix);
+    };
+
+    previous_point = map(previous_point);
+    set_point(map(point), false, false);
+    set_offset_line(line_of(map(top)), false);
+    reconcile_by_scrolling();
+
+    doc->file_info = info;
+    doc->changed_on_disk = false;
+    doc->content_changed = false;
+    discard_journal();
+}
+
+// Crash recovery
+
+bool Buffer::can_recover() const
+{
+    // Journal of a shared document is offered once
+    return !read_only && doc_view == 0 && Journal::can_replay(filename);
+}
+
+// Apply the edits from journal and keep recording into it
+void Buffer::recover()
+{
+    // Edits were made to the whole file
+    finish_loading();
+    before_change();
+
+    Journal::replay(filename, [this](char op, unsigned long index, unsigned long len, std::string_view txt) {
+        if (index > doc->content.size()) {
+            return false;
+        }
+
+        if (op == 'i') {
+            doc->content.insert(index, txt);
+        } else if (index + len <= doc->content.size()) {
+            doc->content.erase(index, len);
+        } else {
+            return false;
+        }
+
+        return true;
+    });
+
+    doc->content_changed = true;
+    update_line_indices();
+    set_point(point, true, true);
+
+    start_journal(true);
+}
+
+// Delete the journal, also when recovery was declined
+void Buffer::discard_journal()
+{
+    if (doc->journal) {
+        doc->journal->discard();
+        doc->journal.reset();
+    } else {
+        std::filesystem::remove(Journal::path_for(filename));
+    }
+}
+
+// Getters
+
+std::string Buffer::get_filename() const
+{
+    return filename;
+}
+
+std::string_view Buffer::get_content() const
+{
+    return view ? view->get_text() : std::string_view { doc->content };
+}
+
+long Buffer::get_point() const
+{
+    return view ? view->get_point() : point;
+}
+
+int Buffer::num_of_lines() const
+{
+    return doc->line_indices.size();
+}
+
+// Return first index of given line
+long Buffer::line_start(int line) const
+{
+    return doc->line_indices[line];
+}
+
+// Return last index of given line
+long Buffer::line_end(int line) const
+{
+    if (line == num_of_lines() - 1) {
+        return doc->content.length();
+    } else {
+        return line_start(line + 1) - 1;
+    }
+}
+
+int Buffer::current_line() const
+{
+    return view ? view->current_line() : line_of(point);
+}
+
+int Buffer::current_real_col() const
+{
+    return point - line_start(current_line());
+}
+
+int Buffer::current_virtual_col() const
+{
+    return view ? view->current_col() : index_to_col(current_line(), point);
+}
+
+// Length of given line in virtual columns
+int Buffer::line_length_cols(int line) const
+{
+    long start = line_start(line);
+    long end = line_end(line);
+
+    if (end - start >= line_chunk_size) {
+        return chunks_of_line(line).back().col;
+    }
+
+    int col = 0;
+    advance_cols(doc->content, start, end, col, INT_MAX);
+    return col;
+}
+
+// Return index of the character that covers given virtual
+// column on line, or the end of line if the line is shorter
+long Buffer::col_to_index(int line, int col) const
+{
+    long index = line_start(line);
+    long end = line_end(line);
+    int current = 0;
+
+    if (col <= 0) {
+        return index;
+    }
+
+    if (end - index >= line_chunk_size) {
+        // Start from the last chunk before the column
+        auto& chunks = chunks_of_line(line);
+        auto chunk = std::upper_bound(chunks.begin(), chunks.end(), col,
+            [](int c, const LineChunk& ch) { return c < ch.col; }) - 1;
+
+        index = chunk->index;
+        current = chunk->col;
+    }
+
+    return advance_cols(doc->content, index, end, current, col);
+}
+
+// Return virtual column of given index on line
+int Buffer::index_to_col(int line, long index) const
+{
+    long start = line_start(line);
+    int col = 0;
+
+    if (line_end(line) - start >= line_chunk_size) {
+        // Start from the last chunk before the index
+        auto& chunks = chunks_of_line(line);
+        auto chunk = std::upper_bound(chunks.begin(), chunks.end(), index,
+            [](long i, const LineChunk& ch) { return i < ch.index; }) - 1;
+
+        start = chunk->index;
+        col = chunk->col;
+    }
+
+    advance_cols(doc->content, start, index, col, INT_MAX);
+    return col;
+}
+
+int Buffer::get_offset_line() const
+{
+    return view ? view->get_top_line() : offset_line;
+}
+
+int Buffer::get_offset_col() const
+{
+    return view ? view->get_offset_col() : offset_col;
+}
+
+bool Buffer::get_edit_mode() const
+{
+    return edit_mode;
+}
+
+bool Buffer::get_content_changed() const
+{
+    return doc->content_changed;
+}
+
+bool Buffer::get_follow() const
+{
+    return follow;
+}
+
+bool Buffer::get_wrap() const
+{
+    return wrap;
+}
+
+int Buffer::get_offset_row() const
+{
+    return offset_row;
 }
 
-void Buffer::write_file()
+// Parts of lines shown on the screen from top to bottom
+std::vector<ScreenRow> Buffer::visible_rows() const
 {
-    auto file = std::ofstream(filename, std::ios_base::out | std::ios_base::binary);
+    if (view) {
+        return view->visible_rows();
+    }
 
-    file.write(content.data(), content.size());
+    std::vector<ScreenRow> result;
+    int height = screen_height - 2;
 
-    if (file.fail()) {
-        error("Unable to write file");
+    if (!wrap) {
+        for (int line = offset_line; line < num_of_lines() && static_cast<int>(result.size()) < height; line++) {
+            long index = col_to_index(line, offset_col);
+            result.push_back(screen_row(line, index, index_to_col(line, index), offset_col));
+        }
+
+        return result;
     }
 
-    content_changed = false;
-}
+    auto pos = top_row();
 
-// Getters
+    while (static_cast<int>(result.size()) < height) {
+        const auto& rows = rows_of_line(pos.line);
+        const auto& row = rows[pos.row];
+        result.push_back(screen_row(pos.line, row.index, row.col, row.col));
 
-std::string Buffer::get_filename() const
-{
-    return filename;
+        if (pos.row + 1 < static_cast<int>(rows.size())) {
+            pos.row++;
+        } else if (pos.line + 1 < num_of_lines()) {
+            pos = { pos.line + 1, 0 };
+        } else {
+            break;
+        }
+    }
+
+    return result;
 }
 
-std::string_view Buffer::get_content() const
+bool Buffer::get_changed_on_disk() const
 {
-    return std::string_view { content };
+    return doc->changed_on_disk;
 }
 
-int Buffer::get_point() const
+HexView* Buffer::get_hex() const
 {
-    return point;
+    return hex.get();
 }
 
-int Buffer::num_of_lines() const
+TextView* Buffer::get_view() const
 {
-    return line_indices.size();
+    return view.get();
 }
 
-// Return first index of given line
-int Buffer::line_start(int line) const
+bool Buffer::get_read_only() const
 {
-    return line_indices[line];
+    return read_only;
 }
 
-// Return last index of given line
-int Buffer::line_end(int line) const
+// Edit the byte at point in hex, value is a hex digit
+void Buffer::set_hex_digit(int value)
 {
-    if (line == num_of_lines() - 1) {
-        return content.length();
-    } else {
-        return line_start(line + 1) - 1;
-    }
+    hex->set_digit(value);
+    doc->content_changed = hex->has_changes();
 }
 
-int Buffer::current_line() const
+long Buffer::get_mark() const
 {
-    int line = num_of_lines() - 1;
+    return mark;
+}
 
-    while (true) {
-        if (point < line_start(line)) {
-            line--;
-        } else {
-            return line;
-        }
+TextStats Buffer::get_stats() const
+{
+    if (view) {
+        return view->get_stats();
     }
+
+    return { num_of_lines(), doc->word_count, static_cast<long>(doc->content.size()), doc->char_count };
 }
 
-int Buffer::current_real_col() const
+// Counts of the text between mark and point
+TextStats Buffer::region_stats() const
 {
-    return point - line_start(current_line());
+    long other = std::min(mark, static_cast<long>(doc->content.size()));
+    long start = std::min(point, other);
+    long end = std::max(point, other);
+
+    // Word that starts before the region is counted too
+    auto region = std::string_view(doc->content).substr(start, end - start);
+
+    return { line_of(end) - line_of(start) + 1, count_word_starts(region, 0, region.size()),
+             end - start, count_chars(region, 0, region.size()) };
 }
 
-int Buffer::current_virtual_col() const
+// Bytes of a cache of vectors by line number: buckets,
+// nodes and the vectors that the nodes own
+template<typename Map>
+long cache_map_bytes(const Map& map)
 {
-#ifdef MED_UTF8
-    return utf8_length_chars(content, line_start(current_line()), point);
-#else
-    // Virtual column is same as real column without UTF-8
-    return current_real_col();
-#endif
+    long bytes = map.bucket_count() * sizeof(void*) +
+        map.size() * (sizeof(void*) + sizeof(typename Map::value_type));
+
+    for (const auto& [line, items] : map) {
+        bytes += items.capacity() * sizeof(typename Map::mapped_type::value_type);
+    }
+
+    return bytes;
 }
 
-int Buffer::get_offset_line() const
+// Caches of this buffer, and the document if with_document is
+// true. A shared document is counted in one buffer only.
+MemoryStats Buffer::memory_usage(bool with_document) const
 {
-    return offset_line;
+    MemoryStats stats;
+
+    stats.caches = cache_map_bytes(wrap_rows);
+
+    if (view) {
+        stats.caches += view->cache_bytes();
+    }
+
+    if (hex) {
+        stats.text = hex->changes_bytes();
+    }
+
+    if (!with_document) {
+        return stats;
+    }
+
+    stats.text += doc->content.capacity();
+
+    if (doc->saver) {
+        stats.text += doc->saver->snapshot_bytes();
+    }
+
+    stats.index = doc->line_indices.capacity() * sizeof(long);
+    stats.caches += cache_map_bytes(doc->line_chunks) + cache_map_bytes(doc->lex_points) +
+        doc->line_states.capacity() + doc->edits.capacity() * sizeof(Document::Edit);
+
+    if (doc->journal) {
+        stats.journal = doc->journal->pending_bytes();
+    }
+
+    return stats;
 }
 
-int Buffer::get_offset_col() const
+unsigned long Buffer::get_version() const
 {
-    return offset_col;
+    return doc->version;
 }
 
-bool Buffer::get_edit_mode() const
+Syntax Buffer::get_syntax() const
 {
-    return edit_mode;
+    return doc->syntax;
 }
 
-bool Buffer::get_content_changed() const
+// Lexer state at start of line
+unsigned char Buffer::line_state(int line) const
 {
-    return content_changed;
+    update_line_states(line);
+    return doc->line_states[line];
 }
 
 // Setters
 
 void Buffer::set_screen_size(int width, int height)
 {
+    if (hex) {
+        hex->set_rows(height - 2);
+    }
+
+    if (view) {
+        view->set_screen_size(width, height);
+        return;
+    }
+
+    catch_up();
+
     if (screen_width != width || screen_height != height) {
+        // Rows depend on the width
+        if (screen_width != width) {
+            wrap_rows.clear();
+        }
+
         screen_width = width;
         screen_height = height;
         reconcile_by_scrolling();
@@ -389,13 +1951,57 @@ void Buffer::set_edit_mode(bool value)
     edit_mode = value;
 }
 
+// Start following the end of file and catch up with what
+// was appended while we were not following
+void Buffer::set_follow(bool value)
+{
+    // Appended bytes of a compressed file cannot be decompressed alone
+    if (doc->compression != Compression::none) {
+        return;
+    }
+
+    follow = value;
+
+    if (follow) {
+        file_changed();
+        end_of_buffer();
+    }
+}
+
+// Scrolling sideways is not needed with wrap
+void Buffer::set_wrap(bool value)
+{
+    wrap = value;
+    offset_col = 0;
+    offset_row = 0;
+
+    reconcile_by_scrolling();
+    goal_col = wrap ? row_col() : current_virtual_col();
+}
+
 void Buffer::store_point_location()
 {
+    if (view) {
+        view->store_point_location();
+        return;
+    }
+
     previous_point = point;
 }
 
+// Mark and point select the lines for line operations
+void Buffer::set_mark()
+{
+    mark = point;
+}
+
 void Buffer::restore_point_location()
 {
+    if (view) {
+        view->restore_point_location();
+        return;
+    }
+
     set_point(previous_point, true, true);
 }
 
@@ -408,69 +2014,93 @@ void Buffer::begin_of_buffer()
 
 void Buffer::end_of_buffer()
 {
-    set_point(content.length(), true, true);
+    if (view) {
+        view->end_of_buffer();
+        return;
+    }
+
+    set_point(doc->content.length(), true, true);
 }
 
-void Buffer::forward_character()
+// Movements take a repeat count. The final position is found
+// first and point is set once, so the view is updated only once.
+
+void Buffer::forward_character(int count)
 {
 #ifdef MED_UTF8
-    set_point(point + utf8_length_bytes(content, point, 1), true, true);
+    set_point(point + utf8_length_bytes(doc->content, point, count), true, true);
 #else
-    set_point(point + 1, true, true);
+    set_point(point + count, true, true);
 #endif
 }
 
-void Buffer::backward_character()
+void Buffer::backward_character(int count)
 {
 #ifdef MED_UTF8
-    set_point(point - utf8_length_bytes_reverse(content, point - 1, 1), true, true);
+    set_point(point - utf8_length_bytes_reverse(doc->content, point - 1, count), true, true);
 #else
-    set_point(point - 1, true, true);
+    set_point(point - count, true, true);
 #endif
 }
 
-void Buffer::forward_word()
+// Index after count words from index
+long Buffer::words_forward(long index, int count) const
 {
-    int result = word_boundary_forward(point);
+    for (int i = 0; i < count; i++) {
+        index = word_boundary_forward(index);
 
-    if (result >= 0) {
-        set_point(result, true, true);
-    } else {
-        end_of_buffer();
+        if (index < 0) {
+            return doc->content.length();
+        }
     }
+
+    return index;
 }
 
-void Buffer::backward_word()
+// Index of the start of count words before index
+long Buffer::words_backward(long index, int count) const
 {
-    int result = word_boundary_backward(point - 1);
+    for (int i = 0; i < count; i++) {
+        index = word_boundary_backward(index - 1);
 
-    if (result >= 0) {
-        set_point(result, true, true);
-    } else {
-        begin_of_buffer();
+        if (index < 0) {
+            return 0;
+        }
     }
+
+    return index;
+}
+
+void Buffer::forward_word(int count)
+{
+    set_point(words_forward(point, count), true, true);
 }
 
-void Buffer::forward_paragraph()
+void Buffer::backward_word(int count)
 {
-    int result = paragraph_boundary_forward(point);
+    set_point(words_backward(point, count), true, true);
+}
 
-    if (result >= 0) {
-        set_point(result, true, true);
-    } else {
-        end_of_buffer();
+void Buffer::forward_paragraph(int count)
+{
+    long index = point;
+
+    for (int i = 0; i < count && index >= 0; i++) {
+        index = paragraph_boundary_forward(index);
     }
+
+    set_point(index >= 0 ? index : doc->content.length(), true, true);
 }
 
-void Buffer::backward_paragraph()
+void Buffer::backward_paragraph(int count)
 {
-    int result = paragraph_boundary_backward(point - 1);
+    long index = point;
 
-    if (result >= 0) {
-        set_point(result, true, true);
-    } else {
-        begin_of_buffer();
+    for (int i = 0; i < count && index >= 0; i++) {
+        index = paragraph_boundary_backward(index - 1);
     }
+
+    set_point(index >= 0 ? index : 0, true, true);
 }
 
 void Buffer::begin_of_line()
@@ -483,22 +2113,54 @@ void Buffer::end_of_line()
     set_point(line_end(current_line()), true, true);
 }
 
-void Buffer::forward_line()
+void Buffer::forward_line(int count)
 {
-    set_line(current_line() + 1, true);
+    if (wrap) {
+        auto current = point_row();
+        auto row = move_rows(current, count);
+
+        if (row != current) {
+            set_row(row, true);
+        }
+
+        return;
+    }
+
+    int current = current_line();
+    int line = std::min(static_cast<long>(current) + count, static_cast<long>(num_of_lines() - 1));
+
+    if (line != current) {
+        set_line(line, true);
+    }
 }
 
-void Buffer::backward_line()
+void Buffer::backward_line(int count)
 {
-    set_line(current_line() - 1, true);
+    if (wrap) {
+        auto current = point_row();
+        auto row = move_rows(current, -static_cast<long>(count));
+
+        if (row != current) {
+            set_row(row, true);
+        }
+
+        return;
+    }
+
+    int current = current_line();
+    int line = std::max(current - count, 0);
+
+    if (line != current) {
+        set_line(line, true);
+    }
 }
 
 void Buffer::back_to_indentation()
 {
     int current = current_line();
-    int i = line_start(current);
+    long i = line_start(current);
 
-    while (i < line_end(current) && (content[i] == ' ' || content[i] == '\t')) {
+    while (i < line_end(current) && (doc->content[i] == ' ' || doc->content[i] == '\t')) {
         i++;
     }
 
@@ -507,6 +2169,18 @@ void Buffer::back_to_indentation()
 
 void Buffer::goto_line(int line)
 {
+    // Rows of 16 bytes are the lines in hex
+    if (hex) {
+        hex->set_point(static_cast<long>(line) * HexView::row_bytes);
+        hex->center();
+        return;
+    }
+
+    if (view) {
+        view->goto_line(line);
+        return;
+    }
+
     if (line < 0) {
         line = 0;
     } else if (line >= num_of_lines()) {
@@ -522,137 +2196,177 @@ void Buffer::goto_line(int line)
 
 void Buffer::scroll_up()
 {
+    if (wrap) {
+        scroll_rows(-1);
+        return;
+    }
+
     set_offset_line(offset_line - 1, true);
 }
 
 void Buffer::scroll_down()
 {
+    if (wrap) {
+        scroll_rows(1);
+        return;
+    }
+
     set_offset_line(offset_line + 1, true);
 }
 
-void Buffer::scroll_left()
+void Buffer::scroll_left(int count)
 {
-    set_offset_col(offset_col - 1, true);
+    if (wrap) {
+        return;
+    }
+
+    set_offset_col(offset_col - count, true);
 }
 
-void Buffer::scroll_right()
+void Buffer::scroll_right(int count)
 {
-    set_offset_col(offset_col + 1, true);
+    if (wrap) {
+        return;
+    }
+
+    set_offset_col(offset_col + count, true);
 }
 
 void Buffer::scroll_current_line_middle()
 {
+    if (wrap) {
+        auto top = move_rows(point_row(), -((screen_height - 2) / 2));
+        offset_line = top.line;
+        offset_row = top.row;
+        return;
+    }
+
     set_offset_line(current_line() - ((screen_height - 2) / 2), true);
 }
 
-void Buffer::scroll_page_up()
+void Buffer::scroll_page_up(int count)
 {
-    set_offset_line(offset_line - screen_height + 3, true);
+    if (wrap) {
+        scroll_rows(-static_cast<long>(screen_height - 3) * count);
+        return;
+    }
+
+    set_offset_line(offset_line - static_cast<long>(screen_height - 3) * count, true);
 }
 
-void Buffer::scroll_page_down()
+void Buffer::scroll_page_down(int count)
 {
-    set_offset_line(offset_line + screen_height - 3, true);
+    if (wrap) {
+        scroll_rows(static_cast<long>(screen_height - 3) * count);
+        return;
+    }
+
+    set_offset_line(offset_line + static_cast<long>(screen_height - 3) * count, true);
 }
 
 // Editing: insertion
 
-void Buffer::insert_character(char c)
+// Character may be several bytes long in UTF-8
+void Buffer::insert_character(std::string_view c, int count)
 {
-    content.insert(point, 1, c);
-    content_changed = true;
-    update_line_indices();
+    std::string txt;
+    txt.reserve(c.length() * count);
+
+    for (int i = 0; i < count; i++) {
+        txt.append(c);
+    }
+
+    insert_text(point, txt);
 
-    forward_character();
+    forward_character(count);
 }
 
 // Editing: deletion
 
-void Buffer::delete_character_forward()
+// Deletions with a repeat count erase all of the text at once
+
+void Buffer::delete_character_forward(int count)
 {
-    if (point < static_cast<int>(content.length())) {
-        content.erase(point, 1);
-        content_changed = true;
-        update_line_indices();
+#ifdef MED_UTF8
+    long n = utf8_length_bytes(doc->content, point, count);
+#else
+    long n = std::min(static_cast<long>(count), static_cast<long>(doc->content.length()) - point);
+#endif
+
+    if (n > 0) {
+        erase_text(point, n);
     }
 }
 
-void Buffer::delete_character_backward()
+void Buffer::delete_character_backward(int count)
 {
-    if (point > 0) {
-        content.erase(point - 1, 1);
-        content_changed = true;
-        update_line_indices();
+#ifdef MED_UTF8
+    long n = utf8_length_bytes_reverse(doc->content, point - 1, count);
+#else
+    long n = std::min(static_cast<long>(count), point);
+#endif
+
+    if (n > 0) {
+        erase_text(point - n, n);
 
-        backward_character();
+        set_point(point - n, true, true);
     }
 }
 
-void Buffer::delete_word_forward()
+void Buffer::delete_word_forward(int count)
 {
-    int len = static_cast<int>(content.length());
-
-    if (point < len) {
-        int result = word_boundary_forward(point);
-
-        if (result >= 0) {
-            content.erase(point, result - point);
-            content_changed = true;
-            update_line_indices();
-        } else {
-            content.erase(point, len - point);
-            content_changed = true;
-            update_line_indices();
-        }
+    if (point < static_cast<long>(doc->content.length())) {
+        erase_text(point, words_forward(point, count) - point);
     }
 }
 
-void Buffer::delete_word_backward()
+void Buffer::delete_word_backward(int count)
 {
     if (point > 0) {
-        int result = word_boundary_backward(point - 1);
+        long start = words_backward(point, count);
 
-        if (result >= 0) {
-            content.erase(result, point - result);
-            content_changed = true;
-            update_line_indices();
+        erase_text(start, point - start);
 
-            set_point(result, true, true);
-        } else {
-            content.erase(0, point);
-            content_changed = true;
-            update_line_indices();
-
-            begin_of_buffer();
-        }
+        set_point(start, true, true);
     }
 }
 
-void Buffer::delete_rest_of_line()
+// Delete to the end of line, or the newline if already there.
+// Each count deletes one of them.
+void Buffer::delete_rest_of_line(int count)
 {
-    int end = line_end(current_line());
+    long end = point;
+    long len = static_cast<long>(doc->content.length());
 
-    if (point < end) {
-        content.erase(point, end - point);
-        content_changed = true;
-        update_line_indices();
-    } else {
-        // Delete one character (the newline)
-        delete_character_forward();
+    for (int i = 0; i < count && end < len; i++) {
+        if (doc->content[end] == '\n') {
+            end++;
+        } else {
+            auto newline = doc->content.find('\n', end);
+            end = newline == std::string::npos ? len : newline;
+        }
+    }
+
+    if (end > point) {
+        erase_text(point, end - point);
     }
 }
 
 // Searching
 
-bool Buffer::search_forward(std::string_view txt)
+bool Buffer::search_forward(std::string_view txt, SearchMode mode)
 {
-    if (point == static_cast<int>(content.length())) {
+    if (view) {
+        return view->search_forward(txt, mode);
+    }
+
+    if (point == static_cast<long>(doc->content.length())) {
         return false;
     }
 
-    auto pos = content.find(txt, point + 1);
+    long pos = Searcher(txt, mode).find(doc->content, point + 1);
 
-    if (pos == std::string::npos) {
+    if (pos < 0) {
         return false;
     }
 
@@ -660,18 +2374,220 @@ bool Buffer::search_forward(std::string_view txt)
     return true;
 }
 
-bool Buffer::search_backward(std::string_view txt)
+bool Buffer::search_backward(std::string_view txt, SearchMode mode)
 {
+    if (view) {
+        return view->search_backward(txt, mode);
+    }
+
     if (point == 0) {
         return false;
     }
 
-    auto pos = content.rfind(txt, point - 1);
+    long pos = Searcher(txt, mode).find_last(doc->content, point - 1);
+
+    if (pos < 0) {
+        return false;
+    }
+
+    set_point(pos, true, true);
+    return true;
+}
+
+// Start counting matches of txt unless already counted
+void Buffer::count_matches(std::string_view txt, SearchMode mode)
+{
+    if (!doc->counter || doc->counter->get_pattern() != txt || doc->counter->get_mode() != mode) {
+        // Old count is cancelled
+        doc->counter.reset();
+
+        if (!txt.empty()) {
+            doc->counter = std::make_unique<MatchCounter>(txt, mode, get_content());
+        }
+    }
+}
+
+// Number of matches or -1 if not known yet
+long Buffer::match_count() const
+{
+    return doc->counter ? doc->counter->get_count() : -1;
+}
+
+// Replacing
+
+// Find the first match at or after point
+bool Buffer::start_replace(std::string_view from, std::string_view to)
+{
+    searcher = std::make_unique<Searcher>(from, SearchMode {});
+    replacement = to;
+
+    if (!find_match(point)) {
+        stop_replace();
+        return false;
+    }
+
+    return true;
+}
+
+// Replace the match at point and move to the next one
+bool Buffer::replace_match()
+{
+    erase_text(point, searcher->length());
+    insert_text(point, replacement);
+
+    // Do not match inside the replacement
+    return find_match(point + replacement.size());
+}
+
+// Move to the next match after the one at point
+bool Buffer::skip_match()
+{
+    return find_match(point + searcher->length());
+}
+
+bool Buffer::find_match(long from)
+{
+    long pos = searcher->find(doc->content, from);
 
-    if (pos == std::string::npos) {
+    if (pos < 0) {
         return false;
     }
 
     set_point(pos, true, true);
     return true;
 }
+
+// Replace all matches from point to end of buffer. The new content
+// is built in one pass and the line indices are updated once.
+long Buffer::replace_all()
+{
+    long len = searcher->length();
+    long first = searcher->find(doc->content, point);
+
+    if (first < 0) {
+        return 0;
+    }
+
+    std::string result;
+    result.reserve(doc->content.size());
+    result.append(doc->content, 0, first);
+
+    long count = 0;
+    long from = first;
+    long pos = first;
+
+    while (pos >= 0) {
+        result.append(doc->content, from, pos - from);
+        result.append(replacement);
+        from = pos + len;
+        count++;
+        pos = searcher->find(doc->content, from);
+    }
+
+    // Journal the changed range as one erase and one insert
+    long new_end = result.size();
+    result.append(doc->content, from);
+
+    start_journal(false);
+    doc->journal->record_erase(first, from - first);
+    doc->journal->record_insert(first, std::string_view(result).substr(first, new_end - first));
+
+    before_change();
+    doc->content.swap(result);
+    doc->content_changed = true;
+    update_line_indices();
+
+    // Point after the last replacement
+    set_point(new_end, true, true);
+    return count;
+}
+
+void Buffer::stop_replace()
+{
+    searcher.reset();
+    replacement.clear();
+}
+
+// Line operations
+
+// Sort, remove duplicates from or filter the lines between mark and
+// point, or all lines if the mark is not set. The lines are handled
+// as views into content and the new content is built in one pass.
+// Returns the number of lines that were removed.
+long Buffer::transform_lines(LineOp op, std::string_view pattern)
+{
+    finish_loading();
+
+    long len = static_cast<long>(doc->content.size());
+    int first = 0;
+    int last = num_of_lines() - 1;
+
+    if (mark >= 0) {
+        long other = std::min(mark, len);
+        first = line_of(std::min(point, other));
+        last = line_of(std::max(point, other));
+    }
+
+    // Empty line after the final newline is not a line of text
+    if (last > first && line_start(last) == len) {
+        last--;
+    }
+
+    std::vector<std::string_view> lines;
+    lines.reserve(last - first + 1);
+
+    for (int line = first; line <= last; line++) {
+        lines.push_back(std::string_view(doc->content).substr(line_start(line), line_end(line) - line_start(line)));
+    }
+
+    long old_count = static_cast<long>(lines.size());
+
+    if (op == LineOp::sort) {
+        sort_lines(lines);
+    } else if (op == LineOp::unique) {
+        unique_lines(lines);
+    } else {
+        filter_lines(lines, pattern, op == LineOp::keep);
+    }
+
+    long start = line_start(first);
+    long end = line_end(last);
+
+    // Newline after the range goes too if no lines are left
+    if (lines.empty() && end < len) {
+        end++;
+    }
+
+    std::string result;
+    result.reserve(doc->content.size());
+    result.append(doc->content, 0, start);
+
+    for (std::size_t i = 0; i < lines.size(); i++) {
+        if (i > 0) {
+            result.append(1, '\n');
+        }
+        result.append(lines[i]);
+    }
+
+    // Journal the range as one erase and one insert
+    long new_end = result.size();
+    result.append(doc->content, end);
+
+    mark = -1;
+
+    if (result == doc->content) {
+        return 0;
+    }
+
+    start_journal(false);
+    doc->journal->record_erase(start, end - start);
+    doc->journal->record_insert(start, std::string_view(result).substr(start, new_end - start));
+
+    before_change();
+    doc->content.swap(result);
+    doc->content_changed = true;
+    update_line_indices();
+
+    set_point(start, true, true);
+    return old_count - static_cast<long>(lines.size());
+}
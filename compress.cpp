@@ -0,0 +1,208 @@
+#include "med.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char** environ;
+
+// Compressed files are read and written through the gzip and zstd
+// programs so we do not need to link with their libraries.
+
+// Find the format from the first bytes of file,
+// or from the name if the file does not exist yet
+Compression detect_compression(const std::string& filename)
+{
+    unsigned char magic[4] = {};
+    int fd = open(filename.c_str(), O_RDONLY);
+
+    if (fd >= 0) {
+        auto n = read(fd, magic, sizeof(magic));
+        close(fd);
+
+        if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+            return Compression::gzip;
+        }
+        if (n >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) {
+            return Compression::zstd;
+        }
+
+        return Compression::none;
+    }
+
+    if (filename.ends_with(".gz")) {
+        return Compression::gzip;
+    }
+    if (filename.ends_with(".zst")) {
+        return Compression::zstd;
+    }
+
+    return Compression::none;
+}
+
+// Run program with given stdin and stdout
+int spawn(std::vector<const char*> argv, int in, int out)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, in, STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
+
+    // Keep error messages of the program from the screen
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+
+    argv.push_back(nullptr);
+
+    pid_t pid;
+    int result = posix_spawnp(&pid, argv[0], &actions, nullptr,
+                              const_cast<char* const*>(argv.data()), environ);
+
+    posix_spawn_file_actions_destroy(&actions);
+
+    return result == 0 ? pid : -1;
+}
+
+// Start decompressing file in the background. The decompressed
+// bytes can be read from the returned pipe which is non-blocking.
+int start_decompress(Compression compression, const std::string& filename, int& pid)
+{
+    int fds[2];
+
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        return -1;
+    }
+
+    int in = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    if (compression == Compression::gzip) {
+        pid = spawn({ "gzip", "-dc", "--", filename.c_str() }, in, fds[1]);
+    } else {
+        pid = spawn({ "zstd", "-dcq", "--", filename.c_str() }, in, fds[1]);
+    }
+
+    close(in);
+    close(fds[1]);
+
+    if (pid < 0) {
+        close(fds[0]);
+        return -1;
+    }
+
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    return fds[0];
+}
+
+// Wait for the program to exit, returns true if it succeeded
+bool finish_process(int pid)
+{
+    int status;
+
+    if (waitpid(pid, &status, 0) != pid) {
+        return false;
+    }
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Compress data into file, the number of bytes
+// given to the compressor is stored in written
+bool compress_into(Compression compression, int out, std::string_view data, std::atomic<long>& written)
+{
+    int fds[2];
+
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        return false;
+    }
+
+    int pid;
+
+    if (compression == Compression::gzip) {
+        pid = spawn({ "gzip", "-c" }, fds[0], out);
+    } else {
+        pid = spawn({ "zstd", "-cq" }, fds[0], out);
+    }
+
+    close(fds[0]);
+
+    bool ok = pid >= 0;
+
+    // Written in chunks to report progress
+    constexpr std::size_t chunk = 1024 * 1024;
+
+    for (std::size_t done = 0; ok && done < data.size(); ) {
+        auto n = write(fds[1], data.data() + done, std::min(chunk, data.size() - done));
+
+        if (n <= 0) {
+            ok = false;
+        } else {
+            done += n;
+            written = done;
+        }
+    }
+
+    close(fds[1]);
+
+    return pid >= 0 && finish_process(pid) && ok;
+}
+
+bool compress_in_place(Compression compression, const std::string& filename,
+                       std::string_view data, std::atomic<long>& written)
+{
+    int out = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+
+    if (out < 0) {
+        return false;
+    }
+
+    bool ok = compress_into(compression, out, data, written);
+    return close(out) == 0 && ok;
+}
+
+// An existing file is replaced only after the compressor succeeded:
+// output goes to a temporary file next to it which is synced and
+// renamed over it, so a missing or failing compressor leaves the file
+// as it was. Symlinks are followed so that the link itself is kept.
+// Files with hard links, files whose owner cannot be kept and files
+// in directories that cannot be written are written in place.
+bool write_compressed(Compression compression, const std::string& filename,
+                      std::string_view data, std::atomic<long>& written)
+{
+    std::error_code ec;
+    auto target = std::filesystem::canonical(filename, ec);
+    struct stat st;
+
+    if (ec || stat(target.c_str(), &st) != 0 || st.st_nlink > 1) {
+        return compress_in_place(compression, filename, data, written);
+    }
+
+    auto temp = target;
+    temp.replace_filename("." + target.filename().string() + ".med-XXXXXX");
+    std::string temp_name = temp.string();
+
+    int out = mkostemp(temp_name.data(), O_CLOEXEC);
+
+    if (out < 0) {
+        return compress_in_place(compression, filename, data, written);
+    }
+
+    if (fchown(out, st.st_uid, st.st_gid) != 0 || fchmod(out, st.st_mode & 07777) != 0) {
+        close(out);
+        unlink(temp_name.c_str());
+        return compress_in_place(compression, filename, data, written);
+    }
+
+    bool ok = compress_into(compression, out, data, written) && fsync(out) == 0;
+    ok = close(out) == 0 && ok;
+
+    if (!ok || rename(temp_name.c_str(), target.c_str()) != 0) {
+        unlink(temp_name.c_str());
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,126 @@
+#include "med.h"
+
+#include <algorithm>
+#include <csignal>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+extern void error(std::string_view txt);
+
+// Written by worker threads to wake up the event loop
+int wake_fd = -1;
+
+void wake_event_loop()
+{
+    if (wake_fd >= 0) {
+        eventfd_write(wake_fd, 1);
+    }
+}
+
+void add_fd(int epoll_fd, int fd)
+{
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+
+    // Already added is fine
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+EventLoop::EventLoop()
+{
+    // Window size changes are read from signalfd, so the
+    // signal must be blocked before any threads are started
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGWINCH);
+
+    if (sigprocmask(SIG_BLOCK, &signals, nullptr) != 0) {
+        error("Unable to block signals");
+    }
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (epoll_fd < 0 || signal_fd < 0 || timer_fd < 0 || wake_fd < 0) {
+        error("Unable to init event loop");
+    }
+
+    add_fd(epoll_fd, STDIN_FILENO);
+    add_fd(epoll_fd, signal_fd);
+    add_fd(epoll_fd, timer_fd);
+    add_fd(epoll_fd, wake_fd);
+}
+
+EventLoop::~EventLoop()
+{
+    close(wake_fd);
+    wake_fd = -1;
+
+    close(timer_fd);
+    close(signal_fd);
+    close(epoll_fd);
+}
+
+// Start a one-shot timer, zero stops it
+void EventLoop::set_timer(int ms)
+{
+    itimerspec spec = {};
+    spec.it_value.tv_sec = ms / 1000;
+    spec.it_value.tv_nsec = (ms % 1000) * 1'000'000L;
+
+    timerfd_settime(timer_fd, 0, &spec, nullptr);
+}
+
+// Wait until something happens or timeout milliseconds have passed,
+// -1 waits forever. Besides the fds of the loop itself, fds are
+// watched for reading. They may change between calls.
+EventLoop::Events EventLoop::wait(const std::vector<int>& fds, int timeout)
+{
+    // Fds are added every time because a closed fd is removed
+    // automatically and its number may have been reused
+    for (int fd : registered) {
+        if (std::find(fds.begin(), fds.end(), fd) == fds.end()) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        }
+    }
+
+    for (int fd : fds) {
+        add_fd(epoll_fd, fd);
+    }
+
+    registered = fds;
+
+    Events result;
+    epoll_event events[16];
+
+    int count = epoll_wait(epoll_fd, events, 16, timeout);
+    result.timeout = count == 0;
+
+    for (int i = 0; i < count; i++) {
+        int fd = events[i].data.fd;
+
+        if (fd == STDIN_FILENO) {
+            result.input = true;
+        } else if (fd == signal_fd) {
+            signalfd_siginfo info;
+            while (read(signal_fd, &info, sizeof(info)) > 0) {}
+            result.resize = true;
+        } else if (fd == timer_fd) {
+            uint64_t expirations;
+            result.timer = read(timer_fd, &expirations, sizeof(expirations)) > 0;
+        } else if (fd == wake_fd) {
+            eventfd_t value;
+            eventfd_read(wake_fd, &value);
+        } else {
+            result.ready.push_back(fd);
+        }
+    }
+
+    return result;
+}
@@ -0,0 +1,271 @@
+#include "med.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+extern void error(std::string_view txt);
+extern bool map_file(const std::string& filename, const char*& data, long& size);
+extern void unmap_file(const char* data, long size);
+
+// Files with a zero byte near the start are shown in hex
+bool is_binary_file(const std::string& filename)
+{
+    char start[8 * 1024];
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    auto n = read(fd, start, sizeof(start));
+    close(fd);
+
+    return n > 0 && memchr(start, '\0', n) != nullptr;
+}
+
+// Map the whole file. Nothing is read until rows are drawn,
+// so opening takes the same time for any size of file.
+HexView::HexView(const std::string& filename)
+{
+    if (!map(filename)) {
+        error("Unable to read file");
+    }
+}
+
+HexView::~HexView()
+{
+    unmap();
+}
+
+bool HexView::map(const std::string& filename)
+{
+    const char* mapped;
+    bool ok = map_file(filename, mapped, size);
+    data = reinterpret_cast<const unsigned char*>(mapped);
+    return ok;
+}
+
+void HexView::unmap()
+{
+    unmap_file(reinterpret_cast<const char*>(data), size);
+    data = nullptr;
+    size = 0;
+}
+
+// Map the file again after its size or identity changed on disk.
+// Pages past the end of a truncated file must not be read, so edits
+// and point beyond the new end are dropped. Returns false if the
+// file could not be mapped, then nothing is shown until it can be.
+bool HexView::remap(const std::string& filename)
+{
+    unmap();
+    bool ok = map(filename);
+
+    if (ok) {
+        changed.erase(changed.lower_bound(size), changed.end());
+    }
+
+    offset_row = std::min(offset_row, last_row());
+    set_point(point);
+    return ok;
+}
+
+long HexView::get_size() const
+{
+    return size;
+}
+
+long HexView::get_point() const
+{
+    return point;
+}
+
+long HexView::get_offset_row() const
+{
+    return offset_row;
+}
+
+int HexView::get_rows() const
+{
+    return rows;
+}
+
+bool HexView::get_low_nibble() const
+{
+    return low_nibble;
+}
+
+bool HexView::has_changes() const
+{
+    return !changed.empty();
+}
+
+// The file is mapped, only edited bytes are allocated. Each
+// is a tree node with three links and a color besides the value.
+long HexView::changes_bytes() const
+{
+    return changed.size() * (4 * sizeof(void*) + sizeof(decltype(changed)::value_type));
+}
+
+// Byte at index with the edits applied
+unsigned char HexView::byte_at(long index) const
+{
+    auto found = changed.find(index);
+    return found == changed.end() ? data[index] : found->second;
+}
+
+bool HexView::is_changed(long index) const
+{
+    return changed.contains(index);
+}
+
+// Row of the last byte, or row 0 if the file is empty
+long HexView::last_row() const
+{
+    return size > 0 ? (size - 1) / row_bytes : 0;
+}
+
+void HexView::set_rows(int value)
+{
+    rows = std::max(1, value);
+    reconcile();
+}
+
+// Scroll so that point is visible
+void HexView::reconcile()
+{
+    long row = point / row_bytes;
+
+    if (row < offset_row) {
+        offset_row = row;
+    } else if (row >= offset_row + rows) {
+        offset_row = row - rows + 1;
+    }
+}
+
+void HexView::set_point(long value)
+{
+    point = std::clamp(value, 0L, std::max(size - 1, 0L));
+    low_nibble = false;
+    reconcile();
+}
+
+// Move point by delta rows, staying in the same column
+void HexView::move_rows(long delta)
+{
+    long row = std::clamp(point / row_bytes + delta, 0L, last_row());
+    set_point(row * row_bytes + point % row_bytes);
+}
+
+// Scroll by delta rows and move point along
+void HexView::scroll_rows(long delta)
+{
+    offset_row = std::clamp(offset_row + delta, 0L, last_row());
+    move_rows(delta);
+}
+
+void HexView::center()
+{
+    offset_row = std::max(0L, point / row_bytes - rows / 2);
+}
+
+// Replace the high or low half of the byte at point. Point moves
+// to the low half, or to the next byte after it.
+bool HexView::set_digit(int value)
+{
+    if (point >= size) {
+        return false;
+    }
+
+    unsigned char byte = byte_at(point);
+
+    if (low_nibble) {
+        byte = (byte & 0xF0) | value;
+    } else {
+        byte = (byte & 0x0F) | (value << 4);
+    }
+
+    if (byte == data[point]) {
+        changed.erase(point);
+    } else {
+        changed[point] = byte;
+    }
+
+    if (low_nibble) {
+        set_point(point + 1);
+    } else {
+        low_nibble = true;
+    }
+
+    return true;
+}
+
+// Write the changed bytes in place, one write for each run of
+// adjacent bytes. Returns an error message if it failed.
+std::string HexView::write(const std::string& filename) const
+{
+    if (changed.empty()) {
+        return {};
+    }
+
+    int fd = open(filename.c_str(), O_WRONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return strerror(errno);
+    }
+
+    std::string run;
+    std::string result;
+
+    for (auto it = changed.begin(); it != changed.end() && result.empty(); ) {
+        long start = it->first;
+        run.clear();
+
+        for (; it != changed.end() && it->first == start + static_cast<long>(run.size()); it++) {
+            run.append(1, static_cast<char>(it->second));
+        }
+
+        if (pwrite(fd, run.data(), run.size(), start) != static_cast<long>(run.size())) {
+            result = errno ? strerror(errno) : "Unable to write file";
+        }
+    }
+
+    if (close(fd) != 0 && result.empty()) {
+        result = strerror(errno);
+    }
+
+    return result;
+}
+
+// Changes were written, the mapping shows them now
+void HexView::clear_changes()
+{
+    changed.clear();
+}
+
+// Width of the offset at the start of rows
+int HexView::offset_width() const
+{
+    int width = 8;
+
+    while (width < 16 && (size - 1) >> (width * 4) > 0) {
+        width++;
+    }
+
+    return width;
+}
+
+// Screen column of the hex digits of byte i of a row. Bytes are
+// in two groups of eight after the offset.
+int HexView::byte_col(int i) const
+{
+    return offset_width() + 2 + i * 3 + (i >= row_bytes / 2 ? 1 : 0);
+}
+
+// Column of the character column after the hex digits
+int HexView::text_col() const
+{
+    return byte_col(row_bytes) + 1;
+}
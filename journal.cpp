@@ -0,0 +1,335 @@
+#include "med.h"
+
+#include <chrono>
+#include <filesystem>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Pending records are written and synced to disk at this interval,
+// so a keystroke only costs appending a few bytes to memory.
+constexpr auto journal_sync_interval = std::chrono::milliseconds(1000);
+
+constexpr std::string_view journal_magic = "med-journal-1\n";
+
+// Records are encoded as an operation byte followed by
+// numbers in LEB128 format, and text for insertions. When a
+// followed file grows, its new identity is recorded like text.
+constexpr char journal_insert = 'i';
+constexpr char journal_erase = 'e';
+constexpr char journal_file = 'f';
+
+void append_number(std::string& out, unsigned long value)
+{
+    while (value >= 0b1000'0000) {
+        out.append(1, static_cast<char>((value & 0b0111'1111) | 0b1000'0000));
+        value >>= 7;
+    }
+
+    out.append(1, static_cast<char>(value));
+}
+
+bool read_number(std::string_view in, std::size_t& pos, unsigned long& value)
+{
+    value = 0;
+
+    for (int shift = 0; pos < in.size() && shift < 64; shift += 7) {
+        unsigned char byte = in[pos++];
+        value |= static_cast<unsigned long>(byte & 0b0111'1111) << shift;
+
+        if (!(byte & 0b1000'0000)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Size and modification time identify the version of
+// the file that the journal records are based on
+std::string file_identity(const std::string& filename)
+{
+    std::string id;
+    struct stat st;
+
+    if (stat(filename.c_str(), &st) == 0) {
+        append_number(id, st.st_size);
+        append_number(id, st.st_mtim.tv_sec);
+        append_number(id, st.st_mtim.tv_nsec);
+    } else {
+        append_number(id, 0);
+        append_number(id, 0);
+        append_number(id, 0);
+    }
+
+    return id;
+}
+
+// Journal is kept next to the file: dir/.name.med-journal
+std::string Journal::path_for(const std::string& filename)
+{
+    auto path = std::filesystem::path(filename);
+    auto name = "." + path.filename().string() + ".med-journal";
+    return path.replace_filename(name).string();
+}
+
+Journal::~Journal()
+{
+    close();
+}
+
+// Start a new journal for file, or continue the existing journal
+bool Journal::open(const std::string& filename, bool resume)
+{
+    path = path_for(filename);
+
+    if (resume) {
+        fd = ::open(path.c_str(), O_WRONLY | O_APPEND);
+    } else {
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+        // Records made before opening follow the header
+        if (fd >= 0) {
+            pending.insert(0, file_identity(filename));
+            pending.insert(0, journal_magic);
+        }
+    }
+
+    // Without a file nothing would drain the records
+    if (fd < 0) {
+        failed = true;
+        pending.clear();
+        pending.shrink_to_fit();
+        return false;
+    }
+
+    stop = false;
+    writer = std::thread(&Journal::run, this);
+    return true;
+}
+
+// Stop the writer and sync what is pending, the file is kept
+void Journal::close()
+{
+    if (fd < 0) {
+        return;
+    }
+
+    {
+        std::lock_guard lock(mutex);
+        stop = true;
+    }
+
+    wakeup.notify_one();
+    writer.join();
+
+    ::close(fd);
+    fd = -1;
+}
+
+// Close and delete the journal when the changes are no longer needed
+void Journal::discard()
+{
+    close();
+
+    pending.clear();
+
+    if (!path.empty()) {
+        unlink(path.c_str());
+    }
+}
+
+void Journal::record_insert(long index, std::string_view txt)
+{
+    if (failed) {
+        return;
+    }
+
+    std::lock_guard lock(mutex);
+
+    pending.append(1, journal_insert);
+    append_number(pending, index);
+    append_number(pending, txt.size());
+    pending.append(txt);
+}
+
+void Journal::record_erase(long index, long len)
+{
+    if (failed) {
+        return;
+    }
+
+    std::lock_guard lock(mutex);
+
+    pending.append(1, journal_erase);
+    append_number(pending, index);
+    append_number(pending, len);
+}
+
+// Text was appended to the file from disk. Records stay valid for
+// the longer file because they only change text before the new end.
+void Journal::record_file(const std::string& filename)
+{
+    if (failed) {
+        return;
+    }
+
+    auto id = file_identity(filename);
+    std::lock_guard lock(mutex);
+
+    pending.append(1, journal_file);
+    append_number(pending, 0);
+    append_number(pending, id.size());
+    pending.append(id);
+}
+
+// Records that are not yet written
+long Journal::pending_bytes()
+{
+    std::lock_guard lock(mutex);
+    return pending.capacity();
+}
+
+// Writer thread: write everything pending and sync it to disk
+// once per interval. Records from many keystrokes are committed
+// together with a single sync.
+void Journal::run()
+{
+    std::string writing;
+    std::unique_lock lock(mutex);
+
+    while (true) {
+        wakeup.wait_for(lock, journal_sync_interval, [this] { return stop; });
+
+        writing.swap(pending);
+        bool stopping = stop;
+
+        lock.unlock();
+
+        if (!writing.empty()) {
+            // Errors are ignored: the journal is only a safety net
+            std::size_t done = 0;
+
+            while (done < writing.size()) {
+                auto n = write(fd, writing.data() + done, writing.size() - done);
+                if (n <= 0) {
+                    break;
+                }
+                done += n;
+            }
+
+            fdatasync(fd);
+            writing.clear();
+        }
+
+        if (stopping) {
+            return;
+        }
+
+        lock.lock();
+    }
+}
+
+std::string read_journal(const std::string& filename)
+{
+    std::string data;
+    int jfd = ::open(Journal::path_for(filename).c_str(), O_RDONLY);
+
+    if (jfd >= 0) {
+        struct stat st;
+
+        if (fstat(jfd, &st) == 0) {
+            data.resize(st.st_size);
+            auto n = read(jfd, data.data(), data.size());
+            data.resize(n < 0 ? 0 : n);
+        }
+
+        ::close(jfd);
+    }
+
+    return data;
+}
+
+// Read the records of journal in order, the identity of a file
+// that grew is given with op journal_file. Reading stops at the
+// first incomplete or invalid record.
+void read_records(std::string_view in, std::size_t pos, const Journal::ReplayFunc& apply)
+{
+    while (pos < in.size()) {
+        char op = in[pos++];
+        unsigned long index, len;
+
+        if (!read_number(in, pos, index) || !read_number(in, pos, len)) {
+            break;
+        }
+
+        if (op == journal_insert || op == journal_file) {
+            if (pos + len > in.size()) {
+                break;
+            }
+
+            if (!apply(op, index, len, in.substr(pos, len))) {
+                break;
+            }
+
+            pos += len;
+        } else if (op == journal_erase) {
+            if (!apply(op, index, len, {})) {
+                break;
+            }
+        } else {
+            break;
+        }
+    }
+}
+
+// Index of the first record, after the identity of the file
+// that the journal was started for
+std::size_t records_start(std::string_view in)
+{
+    std::size_t pos = journal_magic.size();
+    unsigned long value;
+
+    for (int i = 0; i < 3; i++) {
+        if (!read_number(in, pos, value)) {
+            return in.size();
+        }
+    }
+
+    return pos;
+}
+
+// Journal can be replayed if it has records made
+// against the current version of the file
+bool Journal::can_replay(const std::string& filename)
+{
+    auto data = read_journal(filename);
+    std::string_view in = data;
+
+    if (!in.starts_with(journal_magic)) {
+        return false;
+    }
+
+    auto start = records_start(in);
+    auto based_on = in.substr(journal_magic.size(), start - journal_magic.size());
+
+    read_records(in, start, [&](char op, unsigned long, unsigned long, std::string_view id) {
+        if (op == journal_file) {
+            based_on = id;
+        }
+        return true;
+    });
+
+    return in.size() > start && based_on == file_identity(filename);
+}
+
+// Apply the records of journal for filename in order
+void Journal::replay(const std::string& filename, const ReplayFunc& apply)
+{
+    auto data = read_journal(filename);
+    std::string_view in = data;
+
+    read_records(in, records_start(in), [&](char op, unsigned long index, unsigned long len, std::string_view txt) {
+        return op == journal_file || apply(op, index, len, txt);
+    });
+}
@@ -1,32 +1,89 @@
 #include "med.h"
 
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
 #include <tuple>
 #include <ncurses.h>
 
+extern void error(std::string_view txt);
+
 extern PromptType show_prompt;
 extern std::string prompt;
+extern std::string replace_from;
+extern std::string message;
+extern int repeat_count;
+extern SearchMode search_mode;
+extern bool macro_recording;
+
+// Set when a search finds nothing, which ends macro replay
+bool search_failed = false;
+
+// Set when a search finds a match, the replay then goes on
+// until a search fails
+bool search_found = false;
 
-int read_key_no_delay()
+#ifdef MED_UTF8
+// A multibyte character arrives as one key for each byte. The bytes
+// are collected until the character is complete, and the repeat
+// count given for the first byte applies to the whole character.
+std::string typed_char;
+std::size_t typed_length = 0;
+int typed_count = 1;
+
+// Add byte of a typed character, returns true when it is complete
+bool collect_typed_char(int key, int& count)
 {
-    nodelay(stdscr, true);
-    int key = getch();
-    nodelay(stdscr, false);
-    return key;
+    auto byte = static_cast<unsigned char>(key);
+
+    // Start a new character unless this continues an incomplete one
+    if ((byte & 0b1100'0000) != 0b1000'0000 || typed_char.length() >= typed_length) {
+        typed_char.clear();
+        typed_count = count;
+
+        if ((byte & 0b1110'0000) == 0b1100'0000) {
+            typed_length = 2;
+        } else if ((byte & 0b1111'0000) == 0b1110'0000) {
+            typed_length = 3;
+        } else if ((byte & 0b1111'1000) == 0b1111'0000) {
+            typed_length = 4;
+        } else {
+            typed_length = 1;
+        }
+    }
+
+    typed_char.push_back(static_cast<char>(byte));
+
+    count = typed_count;
+    return typed_char.length() >= typed_length;
 }
+#endif
 
-std::tuple<int, bool> read_key()
+// Keys are read without waiting, the event loop
+// waits until there is something to read.
+std::tuple<int, bool> read_key(bool& escape)
 {
     int key = getch();
     bool is_alt = false;
 
-    if (key == 27) {
+    if (escape && key != ERR) {
+        // Key after ESC arrived late, for example over a slow connection
+        escape = false;
+        is_alt = true;
+    } else if (key == 27) {
         // 27 is either ESC or ALT but we have
         // to read second key to find out.
-        int k2 = read_key_no_delay();
+        int k2 = getch();
 
         if (k2 != ERR) {
             key = k2;
             is_alt = true;
+        } else {
+            // Wait for the next key until escape_timeout
+            escape = true;
+            key = ERR;
         }
     }
 
@@ -49,261 +106,1160 @@ std::tuple<int, bool> read_key()
     return { key, is_alt };
 }
 
+// Key bindings are looked up from a table indexed by mode, Alt and
+// key code. The default table is built at compile time and entries
+// can be changed at startup with a keymap file.
+
+constexpr int num_keys = KEY_MAX + 1;
+constexpr int num_modes = static_cast<int>(KeyMode::message) + 1;
+
+using KeyTable = std::array<Command, num_modes * 2 * num_keys>;
+
+constexpr std::size_t key_slot(KeyMode mode, bool alt, int key)
+{
+    return (static_cast<std::size_t>(mode) * 2 + (alt ? 1 : 0)) * num_keys + key;
+}
+
+struct Binding
+{
+    bool alt;
+    int key;
+    Command command;
+};
+
+// Keys shared by command and edit mode
+constexpr Binding movement_bindings[] = {
+    { false, KEY_UP, Command::backward_line },
+    { true, KEY_UP, Command::backward_paragraph },
+    { false, KEY_DOWN, Command::forward_line },
+    { true, KEY_DOWN, Command::forward_paragraph },
+    { false, KEY_LEFT, Command::backward_character },
+    { true, KEY_LEFT, Command::backward_word },
+    { false, KEY_RIGHT, Command::forward_character },
+    { true, KEY_RIGHT, Command::forward_word },
+    { false, KEY_PPAGE, Command::scroll_page_up },
+    { false, KEY_NPAGE, Command::scroll_page_down },
+    { false, KEY_HOME, Command::begin_of_line },
+    { false, KEY_END, Command::end_of_line },
+    { false, KEY_DC, Command::delete_character_forward },
+    { false, KEY_BACKSPACE, Command::delete_character_backward },
+    { true, KEY_BACKSPACE, Command::delete_word_backward },
+    { true, '0', Command::digit_argument },
+    { true, '1', Command::digit_argument },
+    { true, '2', Command::digit_argument },
+    { true, '3', Command::digit_argument },
+    { true, '4', Command::digit_argument },
+    { true, '5', Command::digit_argument },
+    { true, '6', Command::digit_argument },
+    { true, '7', Command::digit_argument },
+    { true, '8', Command::digit_argument },
+    { true, '9', Command::digit_argument },
+    { true, ',', Command::scroll_left },
+    { true, '.', Command::scroll_right },
+    { false, 10, Command::insert_newline },
+    { false, 13, Command::insert_newline },
+    { false, '\t', Command::insert_tab },
+};
+
+// Command mode: keys a to z are reserved for special commands
+constexpr Binding command_bindings[] = {
+    { false, 'a', Command::begin_of_line },
+    { true, 'a', Command::begin_of_buffer },
+    { false, 'b', Command::back_to_indentation },
+    { false, 'c', Command::replace },
+    { false, 'd', Command::delete_character_forward },
+    { true, 'd', Command::delete_word_forward },
+    { false, 'e', Command::end_of_line },
+    { true, 'e', Command::end_of_buffer },
+    { false, 'f', Command::edit_mode },
+    { false, 'g', Command::goto_line },
+    { false, 'h', Command::delete_character_backward },
+    { true, 'h', Command::delete_word_backward },
+    { false, 'i', Command::backward_line },
+    { true, 'i', Command::backward_paragraph },
+    { false, 'j', Command::backward_character },
+    { true, 'j', Command::backward_word },
+    { false, 'k', Command::forward_line },
+    { true, 'k', Command::forward_paragraph },
+    { false, 'l', Command::forward_character },
+    { true, 'l', Command::forward_word },
+    { false, 'm', Command::set_mark },
+    { true, 'm', Command::frame_stats },
+    { false, 'n', Command::next_buffer },
+    { false, 'o', Command::toggle_follow },
+    { true, 'o', Command::toggle_wrap },
+    { false, 'p', Command::prev_buffer },
+    { false, 'q', Command::quit },
+    { false, 'r', Command::scroll_current_line_middle },
+    { false, 's', Command::search },
+    { false, 't', Command::delete_rest_of_line },
+    { false, 'u', Command::reload },
+    { true, 'u', Command::memory_stats },
+    { false, 'v', Command::scroll_page_down },
+    { true, 'v', Command::scroll_page_up },
+    { false, 'w', Command::write },
+    { true, 'w', Command::text_stats },
+    { false, 'x', Command::line_command },
+    { false, 'z', Command::macro_record },
+    { true, 'z', Command::macro_play },
+};
+
+constexpr Binding edit_bindings[] = {
+    { true, 'j', Command::command_mode },
+};
+
+// Prompts that are answered with one key
+constexpr Binding quit_bindings[] = {
+    { false, 'y', Command::prompt_yes },
+    { false, 'Y', Command::prompt_yes },
+    { false, 'n', Command::prompt_no },
+    { false, 'N', Command::prompt_no },
+    { false, 'a', Command::prompt_all },
+    { false, 'A', Command::prompt_all },
+    { false, 'q', Command::prompt_abort },
+    { false, 'Q', Command::prompt_abort },
+};
+
+constexpr Binding yes_no_bindings[] = {
+    { false, 'y', Command::prompt_yes },
+    { false, 'Y', Command::prompt_yes },
+    { false, 'n', Command::prompt_no },
+    { false, 'N', Command::prompt_no },
+};
+
+// Reload and write can also be cancelled with q
+constexpr Binding cancel_bindings[] = {
+    { false, 'q', Command::prompt_no },
+};
+
+constexpr Binding replace_query_bindings[] = {
+    { false, 'y', Command::replace_one },
+    { false, 'Y', Command::replace_one },
+    { false, ' ', Command::replace_one },
+    { false, 'n', Command::replace_skip },
+    { false, 'N', Command::replace_skip },
+    { false, '!', Command::replace_rest },
+    { false, 'q', Command::prompt_abort },
+    { false, 10, Command::prompt_abort },
+    { false, 13, Command::prompt_abort },
+};
+
+// Prompts where text is written
+constexpr Binding text_bindings[] = {
+    { false, 10, Command::prompt_accept },
+    { false, 13, Command::prompt_accept },
+    { false, KEY_BACKSPACE, Command::prompt_backspace },
+    { true, KEY_BACKSPACE, Command::prompt_clear },
+    { true, 'q', Command::prompt_abort },
+};
+
+constexpr Binding search_bindings[] = {
+    { true, 's', Command::search_forward },
+    { true, 'n', Command::search_forward },
+    { true, 'k', Command::search_forward },
+    { true, 'r', Command::search_backward },
+    { true, 'p', Command::search_backward },
+    { true, 'i', Command::search_backward },
+    { true, 'c', Command::toggle_ignore_case },
+    { true, 'w', Command::toggle_whole_word },
+};
+
+constexpr Binding goline_bindings[] = {
+    { false, 'q', Command::prompt_abort },
+};
+
 constexpr bool is_printable_char(int key)
 {
     // Normal ascii or extended ascii
     return (key >= 32 && key <= 126) || (key >= 128 && key <= 255);
 }
 
-InputResult Keyboard::read_input(Buffer& buffer)
+template<std::size_t N>
+constexpr void bind(KeyTable& table, KeyMode mode, const Binding (&bindings)[N])
 {
-    int key;
-    bool is_alt;
+    for (const auto& binding : bindings) {
+        table[key_slot(mode, binding.alt, binding.key)] = binding.command;
+    }
+}
 
-    std::tie(key, is_alt) = read_key();
+// Fill keys of mode that are not bound otherwise
+constexpr void bind_keys(KeyTable& table, KeyMode mode, bool (*keys)(int), Command command)
+{
+    for (int key = 0; key < num_keys; key++) {
+        if (keys(key)) {
+            table[key_slot(mode, false, key)] = command;
+            table[key_slot(mode, true, key)] = command;
+        }
+    }
+}
 
-    // Resize window
-    if (key == KEY_RESIZE) {
-        return InputResult::screen_size;
+constexpr KeyTable make_default_keys()
+{
+    KeyTable table {};
+
+    // Printable characters are inserted, also with Alt
+    bind_keys(table, KeyMode::edit, is_printable_char, Command::insert_char);
+    bind_keys(table, KeyMode::command, [](int key) {
+        return is_printable_char(key) && !(key >= 'a' && key <= 'z');
+    }, Command::insert_char);
+
+    bind(table, KeyMode::edit, movement_bindings);
+    bind(table, KeyMode::edit, edit_bindings);
+    bind(table, KeyMode::command, movement_bindings);
+    bind(table, KeyMode::command, command_bindings);
+
+    bind(table, KeyMode::quit, quit_bindings);
+    bind(table, KeyMode::recover, yes_no_bindings);
+    bind(table, KeyMode::reload, yes_no_bindings);
+    bind(table, KeyMode::reload, cancel_bindings);
+    bind(table, KeyMode::write, yes_no_bindings);
+    bind(table, KeyMode::write, cancel_bindings);
+    bind(table, KeyMode::replace_query, replace_query_bindings);
+
+    bind_keys(table, KeyMode::goline, [](int key) { return key >= '0' && key <= '9'; }, Command::prompt_insert);
+    bind(table, KeyMode::goline, text_bindings);
+    bind(table, KeyMode::goline, goline_bindings);
+
+    bind_keys(table, KeyMode::search, is_printable_char, Command::prompt_insert);
+    bind(table, KeyMode::search, text_bindings);
+    bind(table, KeyMode::search, search_bindings);
+
+    bind_keys(table, KeyMode::replace, [](int key) { return key == '\t' || is_printable_char(key); },
+              Command::prompt_insert);
+    bind(table, KeyMode::replace, text_bindings);
+
+    bind_keys(table, KeyMode::lines, is_printable_char, Command::prompt_insert);
+    bind(table, KeyMode::lines, text_bindings);
+
+    // Any key closes the message
+    bind_keys(table, KeyMode::message, [](int) { return true; }, Command::dismiss);
+
+    return table;
+}
+
+// Bindings in use, starting with the defaults
+KeyTable keys = make_default_keys();
+
+// Names used in keymap file
+
+constexpr std::pair<std::string_view, KeyMode> mode_names[] = {
+    { "command", KeyMode::command },
+    { "edit", KeyMode::edit },
+    { "quit", KeyMode::quit },
+    { "recover", KeyMode::recover },
+    { "reload", KeyMode::reload },
+    { "write", KeyMode::write },
+    { "goline", KeyMode::goline },
+    { "search", KeyMode::search },
+    { "replace", KeyMode::replace },
+    { "replace-query", KeyMode::replace_query },
+    { "lines", KeyMode::lines },
+    { "message", KeyMode::message },
+};
+
+constexpr std::pair<std::string_view, Command> command_names[] = {
+    { "none", Command::none },
+    { "begin-of-buffer", Command::begin_of_buffer },
+    { "end-of-buffer", Command::end_of_buffer },
+    { "forward-character", Command::forward_character },
+    { "backward-character", Command::backward_character },
+    { "forward-word", Command::forward_word },
+    { "backward-word", Command::backward_word },
+    { "forward-paragraph", Command::forward_paragraph },
+    { "backward-paragraph", Command::backward_paragraph },
+    { "begin-of-line", Command::begin_of_line },
+    { "end-of-line", Command::end_of_line },
+    { "forward-line", Command::forward_line },
+    { "backward-line", Command::backward_line },
+    { "back-to-indentation", Command::back_to_indentation },
+    { "scroll-left", Command::scroll_left },
+    { "scroll-right", Command::scroll_right },
+    { "scroll-current-line-middle", Command::scroll_current_line_middle },
+    { "scroll-page-up", Command::scroll_page_up },
+    { "scroll-page-down", Command::scroll_page_down },
+    { "insert-char", Command::insert_char },
+    { "insert-newline", Command::insert_newline },
+    { "insert-tab", Command::insert_tab },
+    { "delete-character-forward", Command::delete_character_forward },
+    { "delete-character-backward", Command::delete_character_backward },
+    { "delete-word-forward", Command::delete_word_forward },
+    { "delete-word-backward", Command::delete_word_backward },
+    { "delete-rest-of-line", Command::delete_rest_of_line },
+    { "edit-mode", Command::edit_mode },
+    { "command-mode", Command::command_mode },
+    { "goto-line", Command::goto_line },
+    { "search", Command::search },
+    { "replace", Command::replace },
+    { "write", Command::write },
+    { "reload", Command::reload },
+    { "quit", Command::quit },
+    { "toggle-follow", Command::toggle_follow },
+    { "toggle-wrap", Command::toggle_wrap },
+    { "next-buffer", Command::next_buffer },
+    { "prev-buffer", Command::prev_buffer },
+    { "frame-stats", Command::frame_stats },
+    { "text-stats", Command::text_stats },
+    { "memory-stats", Command::memory_stats },
+    { "digit-argument", Command::digit_argument },
+    { "macro-record", Command::macro_record },
+    { "macro-play", Command::macro_play },
+    { "set-mark", Command::set_mark },
+    { "line-command", Command::line_command },
+    { "prompt-yes", Command::prompt_yes },
+    { "prompt-no", Command::prompt_no },
+    { "prompt-all", Command::prompt_all },
+    { "prompt-abort", Command::prompt_abort },
+    { "prompt-accept", Command::prompt_accept },
+    { "prompt-insert", Command::prompt_insert },
+    { "prompt-backspace", Command::prompt_backspace },
+    { "prompt-clear", Command::prompt_clear },
+    { "search-forward", Command::search_forward },
+    { "search-backward", Command::search_backward },
+    { "toggle-ignore-case", Command::toggle_ignore_case },
+    { "toggle-whole-word", Command::toggle_whole_word },
+    { "replace-one", Command::replace_one },
+    { "replace-skip", Command::replace_skip },
+    { "replace-rest", Command::replace_rest },
+    { "dismiss", Command::dismiss },
+};
+
+constexpr std::pair<std::string_view, int> key_names[] = {
+    { "up", KEY_UP },
+    { "down", KEY_DOWN },
+    { "left", KEY_LEFT },
+    { "right", KEY_RIGHT },
+    { "pageup", KEY_PPAGE },
+    { "pagedown", KEY_NPAGE },
+    { "home", KEY_HOME },
+    { "end", KEY_END },
+    { "delete", KEY_DC },
+    { "backspace", KEY_BACKSPACE },
+    { "enter", 10 },
+    { "return", 13 },
+    { "tab", '\t' },
+    { "space", ' ' },
+};
+
+template<typename T, std::size_t N>
+bool find_name(const std::pair<std::string_view, T> (&names)[N], std::string_view name, T& value)
+{
+    for (const auto& entry : names) {
+        if (entry.first == name) {
+            value = entry.second;
+            return true;
+        }
     }
 
-    // Quit-prompt
-    if (show_prompt == PromptType::quit) {
-        if (key == 'q' || key == 'Q') {
-            return InputResult::prompt_quit;
-        } else if (key == 'y' || key == 'Y') {
-            return InputResult::prompt_yes;
-        } else if (key == 'n' || key == 'N') {
-            return InputResult::prompt_no;
+    return false;
+}
+
+// Keys are written as a character, a name such as "up",
+// C-x for control characters and M- prefix for Alt
+bool parse_key(std::string_view name, bool& alt, int& key)
+{
+    alt = name.starts_with("M-") && name.size() > 2;
+
+    if (alt) {
+        name.remove_prefix(2);
+    }
+
+    if (name.size() == 1) {
+        key = static_cast<unsigned char>(name[0]);
+        return true;
+    }
+
+    if (name.size() == 3 && name.starts_with("C-") && name[2] >= 'a' && name[2] <= 'z') {
+        key = name[2] - 'a' + 1;
+        return true;
+    }
+
+    return find_name(key_names, name, key);
+}
+
+// Read bindings from file, one per line: mode, key and command.
+// Lines starting with # are comments.
+void load_keymap(const std::string& path)
+{
+    auto file = std::ifstream(path);
+    std::string line;
+
+    for (int number = 1; std::getline(file, line); number++) {
+        std::istringstream words(line);
+        std::string mode_name, key_name, command_name, extra;
+
+        if (!(words >> mode_name) || mode_name.starts_with("#")) {
+            continue;
         }
 
-        return InputResult::none;
+        auto mode = KeyMode::command;
+        bool alt;
+        int key;
+        auto command = Command::none;
+
+        if (!(words >> key_name >> command_name) || (words >> extra) ||
+            !find_name(mode_names, mode_name, mode) || !parse_key(key_name, alt, key) ||
+            !find_name(command_names, command_name, command)) {
+            error("Invalid keymap " + path + " line " + std::to_string(number));
+        }
+
+        keys[key_slot(mode, alt, key)] = command;
+    }
+}
+
+// Keymap file is $XDG_CONFIG_HOME/med/keymap or ~/.config/med/keymap
+std::string keymap_path()
+{
+    if (auto config = std::getenv("XDG_CONFIG_HOME"); config && *config) {
+        return std::string(config) + "/med/keymap";
     }
 
-    // Goto prompt
+    if (auto home = std::getenv("HOME"); home && *home) {
+        return std::string(home) + "/.config/med/keymap";
+    }
+
+    return {};
+}
+
+Keyboard::Keyboard()
+{
+    auto path = keymap_path();
+
+    if (!path.empty()) {
+        load_keymap(path);
+    }
+}
+
+// Is there input that can be read without waiting.
+// Also notices keys already buffered inside ncurses
+// and queued keys that can be handled now.
+bool Keyboard::input_pending()
+{
+    if (!queued.empty() && queued_for->can_edit()) {
+        return true;
+    }
+
+    int key = getch();
+
+    if (key == ERR) {
+        return false;
+    }
+
+    ungetch(key);
+    return true;
+}
+
+bool Keyboard::escape_pending() const
+{
+    return escape;
+}
+
+// No key came after ESC: it was pressed alone
+void Keyboard::escape_timeout()
+{
+    escape = false;
+}
+
+// Larger counts are not accepted
+constexpr int max_repeat_count = 100'000'000;
+
+// Mode for looking up keys
+KeyMode key_mode(const Buffer& buffer)
+{
+    switch (show_prompt) {
+    case PromptType::none:
+        return buffer.get_edit_mode() ? KeyMode::edit : KeyMode::command;
+    case PromptType::quit:
+        return KeyMode::quit;
+    case PromptType::recover:
+        return KeyMode::recover;
+    case PromptType::reload:
+        return KeyMode::reload;
+    case PromptType::write:
+        return KeyMode::write;
+    case PromptType::goline:
+        return KeyMode::goline;
+    case PromptType::search:
+        return KeyMode::search;
+    case PromptType::replace:
+    case PromptType::replace_with:
+        return KeyMode::replace;
+    case PromptType::replace_query:
+        return KeyMode::replace_query;
+    case PromptType::lines:
+        return KeyMode::lines;
+    case PromptType::message:
+        return KeyMode::message;
+    }
+
+    return KeyMode::command;
+}
+
+// Answer to a prompt that asks yes or no
+InputResult answer_prompt(Buffer& buffer, bool yes)
+{
+    if (show_prompt == PromptType::quit || show_prompt == PromptType::recover) {
+        return yes ? InputResult::prompt_yes : InputResult::prompt_no;
+    }
+
+    // Closed first so that an error can be shown
+    auto type = show_prompt;
+    show_prompt = PromptType::none;
+
+    if (yes && type == PromptType::reload) {
+        buffer.reload();
+    } else if (yes && type == PromptType::write) {
+        buffer.write_file();
+    }
+
+    return InputResult::none;
+}
+
+// Run a line operation written as its name and a pattern
+// for filters, for example "keep ERROR"
+void run_line_command(Buffer& buffer, std::string_view command)
+{
+    auto space = command.find(' ');
+    auto name = command.substr(0, space);
+    auto pattern = space == std::string_view::npos ? std::string_view() : command.substr(space + 1);
+    long removed;
+
+    if (name == "sort") {
+        buffer.transform_lines(LineOp::sort, {});
+        message = "Lines sorted";
+    } else if (name == "uniq") {
+        removed = buffer.transform_lines(LineOp::unique, {});
+        message = "Removed " + std::to_string(removed) + " duplicate lines";
+    } else if ((name == "keep" || name == "flush") && !pattern.empty()) {
+        removed = buffer.transform_lines(name == "keep" ? LineOp::keep : LineOp::flush, pattern);
+        message = "Removed " + std::to_string(removed) + " lines";
+    } else {
+        message = "Unknown line command: " + std::string(command);
+    }
+
+    show_prompt = PromptType::message;
+}
+
+// Enter in a prompt where text is written
+void accept_prompt(Buffer& buffer)
+{
     if (show_prompt == PromptType::goline) {
-        // Quit with q
-        if (key == 'q') {
-            buffer.restore_point_location();
-            show_prompt = PromptType::none;
-        } else if (key == 10 || key == 13) {
-            // Enter: perform goto line
-            try {
-                buffer.goto_line(std::stoi(prompt) - 1);
-            } catch (...) {}
+        try {
+            buffer.goto_line(std::stoi(prompt) - 1);
+        } catch (...) {}
+        show_prompt = PromptType::none;
+    } else if (show_prompt == PromptType::search) {
+        // Keep point at current location
+        show_prompt = PromptType::none;
+    } else if (show_prompt == PromptType::replace) {
+        if (prompt.length() > 0) {
+            replace_from = prompt;
+            prompt.clear();
+            show_prompt = PromptType::replace_with;
+        }
+    } else if (show_prompt == PromptType::replace_with) {
+        if (buffer.start_replace(replace_from, prompt)) {
+            show_prompt = PromptType::replace_query;
+        } else {
             show_prompt = PromptType::none;
-        } else if (key == KEY_BACKSPACE) {
-            if (prompt.length() > 0) {
-                if (is_alt) {
-                    // Alt-backspace erases all
-                    prompt.clear();
-                } else {
-                    prompt.erase(prompt.length() - 1, 1);
-                }
-            }
-        } else if (key >= '0' && key <= '9') {
-            prompt.insert(prompt.length(), 1, key);
         }
+    } else if (show_prompt == PromptType::lines) {
+        run_line_command(buffer, prompt);
+    }
+}
 
-        return InputResult::none;
+// Leave a prompt without doing anything
+InputResult abort_prompt(Buffer& buffer)
+{
+    if (show_prompt == PromptType::quit) {
+        return InputResult::prompt_quit;
     }
 
-    // Search prompt
-    if (show_prompt == PromptType::search) {
-        // Quit with Alt-q
-        if (key == 'q' && is_alt) {
-            // Quit: restore point to location before search
-            buffer.restore_point_location();
-            show_prompt = PromptType::none;
-        } else if (key == 10 || key == 13) {
-            // Enter: keep point at current location
-            show_prompt = PromptType::none;
-        } else if ((key == 's' || key == 'n' || key == 'k') && is_alt) {
-            // Search forward
-            if (prompt.length() > 0) {
-                buffer.search_forward(prompt);
-            }
-        } else if ((key == 'r' || key == 'p' || key == 'i') && is_alt) {
-            // Search backward
-            if (prompt.length() > 0) {
-                buffer.search_backward(prompt);
-            }
-        } else if (key == KEY_BACKSPACE) {
-            if (prompt.length() > 0) {
-                if (is_alt) {
-                    // Alt-backspace erases all
-                    prompt.clear();
-                } else {
-                    prompt.erase(prompt.length() - 1, 1);
-                }
+    if (show_prompt == PromptType::goline || show_prompt == PromptType::search) {
+        // Restore point to location before the prompt
+        buffer.restore_point_location();
+    } else if (show_prompt == PromptType::replace_query) {
+        buffer.stop_replace();
+    }
+
+    show_prompt = PromptType::none;
+    return InputResult::none;
+}
+
+void open_prompt(PromptType type)
+{
+    prompt.clear();
+    show_prompt = type;
+}
+
+// Value of a hex digit or -1
+int hex_digit_value(int key)
+{
+    if (key >= '0' && key <= '9') {
+        return key - '0';
+    } else if (key >= 'a' && key <= 'f') {
+        return key - 'a' + 10;
+    } else if (key >= 'A' && key <= 'F') {
+        return key - 'A' + 10;
+    }
+
+    return -1;
+}
+
+// Commands on a buffer shown in hex. Returns false for commands
+// that do not depend on the content, which are run as usual.
+// Text editing commands do nothing because the size is fixed.
+bool run_hex_command(Command command, int key, int count, Buffer& buffer)
+{
+    auto hex = buffer.get_hex();
+    long rows = hex->get_rows();
+
+    switch (command) {
+    case Command::begin_of_buffer:
+        hex->set_point(0);
+        break;
+    case Command::end_of_buffer:
+        hex->set_point(hex->get_size());
+        break;
+    case Command::forward_character:
+        hex->set_point(hex->get_point() + count);
+        break;
+    case Command::backward_character:
+        hex->set_point(hex->get_point() - count);
+        break;
+    case Command::forward_line:
+        hex->move_rows(count);
+        break;
+    case Command::backward_line:
+        hex->move_rows(-count);
+        break;
+    case Command::begin_of_line:
+    case Command::back_to_indentation:
+        hex->set_point(hex->get_point() / HexView::row_bytes * HexView::row_bytes);
+        break;
+    case Command::end_of_line:
+        hex->set_point(hex->get_point() / HexView::row_bytes * HexView::row_bytes + HexView::row_bytes - 1);
+        break;
+    case Command::scroll_page_up:
+    case Command::backward_paragraph:
+        hex->scroll_rows(-rows * count);
+        break;
+    case Command::scroll_page_down:
+    case Command::forward_paragraph:
+        hex->scroll_rows(rows * count);
+        break;
+    case Command::scroll_current_line_middle:
+        hex->center();
+        break;
+    case Command::insert_char:
+        if (hex_digit_value(key) >= 0) {
+            for (int i = 0; i < count; i++) {
+                buffer.set_hex_digit(hex_digit_value(key));
             }
-        } else if (is_printable_char(key)) {
-            // Printable characters
-            prompt.insert(prompt.length(), 1, key);
         }
+        break;
+    case Command::forward_word:
+    case Command::backward_word:
+    case Command::scroll_left:
+    case Command::scroll_right:
+    case Command::insert_newline:
+    case Command::insert_tab:
+    case Command::delete_character_forward:
+    case Command::delete_character_backward:
+    case Command::delete_word_forward:
+    case Command::delete_word_backward:
+    case Command::delete_rest_of_line:
+    case Command::search:
+    case Command::replace:
+    case Command::line_command:
+    case Command::set_mark:
+    case Command::toggle_follow:
+    case Command::toggle_wrap:
+        break;
+    default:
+        return false;
+    }
+
+    return true;
+}
 
+// Movement commands on a buffer shown by a view. Returns false
+// for commands that are run as usual, which the buffer passes on
+// to the view when needed.
+bool run_view_command(Command command, int count, Buffer& buffer)
+{
+    auto view = buffer.get_view();
+
+    switch (command) {
+    case Command::begin_of_buffer:
+        view->begin_of_buffer();
+        break;
+    case Command::end_of_buffer:
+        view->end_of_buffer();
+        break;
+    case Command::forward_character:
+        view->forward_character(count);
+        break;
+    case Command::backward_character:
+        view->backward_character(count);
+        break;
+    case Command::forward_word:
+        view->forward_word(count);
+        break;
+    case Command::backward_word:
+        view->backward_word(count);
+        break;
+    case Command::begin_of_line:
+        view->begin_of_line();
+        break;
+    case Command::end_of_line:
+        view->end_of_line();
+        break;
+    case Command::forward_line:
+        view->forward_line(count);
+        break;
+    case Command::backward_line:
+        view->backward_line(count);
+        break;
+    case Command::back_to_indentation:
+        view->back_to_indentation();
+        break;
+    case Command::scroll_left:
+        view->scroll_left(count);
+        break;
+    case Command::scroll_right:
+        view->scroll_right(count);
+        break;
+    case Command::scroll_current_line_middle:
+        view->scroll_current_line_middle();
+        break;
+    case Command::scroll_page_up:
+    case Command::backward_paragraph:
+        view->scroll_page_up(count);
+        break;
+    case Command::scroll_page_down:
+    case Command::forward_paragraph:
+        view->scroll_page_down(count);
+        break;
+    case Command::set_mark:
+    case Command::toggle_wrap:
+        break;
+    default:
+        return false;
+    }
+
+    return true;
+}
+
+// Commands that change the buffer
+bool is_edit_command(Command command)
+{
+    switch (command) {
+    case Command::insert_char:
+    case Command::insert_newline:
+    case Command::insert_tab:
+    case Command::delete_character_forward:
+    case Command::delete_character_backward:
+    case Command::delete_word_forward:
+    case Command::delete_word_backward:
+    case Command::delete_rest_of_line:
+    case Command::edit_mode:
+    case Command::replace:
+    case Command::write:
+    case Command::line_command:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Commands that change the text right away, outside of prompts
+bool changes_text(Command command)
+{
+    if (show_prompt == PromptType::replace_query) {
+        return command == Command::replace_one || command == Command::replace_rest;
+    }
+
+    if (show_prompt != PromptType::none) {
+        return false;
+    }
+
+    switch (command) {
+    case Command::insert_char:
+    case Command::insert_newline:
+    case Command::insert_tab:
+    case Command::delete_character_forward:
+    case Command::delete_character_backward:
+    case Command::delete_word_forward:
+    case Command::delete_word_backward:
+    case Command::delete_rest_of_line:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Run the command bound to key. Commands that can be
+// repeated are done count times as a single step.
+InputResult run_command(Command command, int key, int count, Buffer& buffer)
+{
+    if (buffer.get_read_only() && is_edit_command(command)) {
+        message = "Buffer is read-only";
+        show_prompt = PromptType::message;
         return InputResult::none;
     }
 
-    // Write prompt
-    if (show_prompt == PromptType::write) {
-        if (key == 'y' || key == 'Y') {
-            buffer.write_file();
-            show_prompt = PromptType::none;
-        } else if (key == 'n' || key == 'N' || key == 'q') {
-            show_prompt = PromptType::none;
-        }
+    if (buffer.get_hex() && show_prompt == PromptType::none && run_hex_command(command, key, count, buffer)) {
+        return InputResult::none;
+    }
 
+    if (buffer.get_view() && show_prompt == PromptType::none && run_view_command(command, count, buffer)) {
         return InputResult::none;
     }
 
-    // -- not in prompt if we get here --
+    switch (command) {
+    case Command::none:
+        break;
+
+    // Movement
+    case Command::begin_of_buffer:
+        buffer.begin_of_buffer();
+        break;
+    case Command::end_of_buffer:
+        buffer.end_of_buffer();
+        break;
+    case Command::forward_character:
+        buffer.forward_character(count);
+        break;
+    case Command::backward_character:
+        buffer.backward_character(count);
+        break;
+    case Command::forward_word:
+        buffer.forward_word(count);
+        break;
+    case Command::backward_word:
+        buffer.backward_word(count);
+        break;
+    case Command::forward_paragraph:
+        buffer.forward_paragraph(count);
+        break;
+    case Command::backward_paragraph:
+        buffer.backward_paragraph(count);
+        break;
+    case Command::begin_of_line:
+        buffer.begin_of_line();
+        break;
+    case Command::end_of_line:
+        buffer.end_of_line();
+        break;
+    case Command::forward_line:
+        buffer.forward_line(count);
+        break;
+    case Command::backward_line:
+        buffer.backward_line(count);
+        break;
+    case Command::back_to_indentation:
+        buffer.back_to_indentation();
+        break;
+
+    // Scrolling
+    case Command::scroll_left:
+        buffer.scroll_left(count);
+        break;
+    case Command::scroll_right:
+        buffer.scroll_right(count);
+        break;
+    case Command::scroll_current_line_middle:
+        buffer.scroll_current_line_middle();
+        break;
+    case Command::scroll_page_up:
+        buffer.scroll_page_up(count);
+        break;
+    case Command::scroll_page_down:
+        buffer.scroll_page_down(count);
+        break;
+
+    // Editing
+    case Command::insert_char:
+#ifdef MED_UTF8
+        if (collect_typed_char(key, count)) {
+            buffer.insert_character(typed_char, count);
+        }
+#else
+        buffer.insert_character(std::string(1, static_cast<char>(key)), count);
+#endif
+        break;
+    case Command::insert_newline:
+        buffer.insert_character("\n", count);
+        break;
+    case Command::insert_tab:
+        buffer.insert_character("\t", count);
+        break;
+    case Command::delete_character_forward:
+        buffer.delete_character_forward(count);
+        break;
+    case Command::delete_character_backward:
+        buffer.delete_character_backward(count);
+        break;
+    case Command::delete_word_forward:
+        buffer.delete_word_forward(count);
+        break;
+    case Command::delete_word_backward:
+        buffer.delete_word_backward(count);
+        break;
+    case Command::delete_rest_of_line:
+        buffer.delete_rest_of_line(count);
+        break;
 
-    // Enter command mode: alt-j
-    if (buffer.get_edit_mode() && key == 'j' && is_alt) {
+    // Modes and prompts
+    case Command::edit_mode:
+        buffer.set_edit_mode(true);
+        break;
+    case Command::command_mode:
         buffer.set_edit_mode(false);
+        break;
+    case Command::goto_line:
+        buffer.store_point_location();
+        open_prompt(PromptType::goline);
+        break;
+    case Command::search:
+        buffer.store_point_location();
+        open_prompt(PromptType::search);
+        break;
+    case Command::replace:
+        open_prompt(PromptType::replace);
+        break;
+    case Command::write:
+        show_prompt = PromptType::write;
+        break;
+    case Command::reload:
+        show_prompt = PromptType::reload;
+        break;
+    case Command::quit:
+        show_prompt = PromptType::quit;
+        break;
+    case Command::set_mark:
+        buffer.set_mark();
+        break;
+    case Command::line_command:
+        open_prompt(PromptType::lines);
+        break;
+    case Command::toggle_follow:
+        buffer.set_follow(!buffer.get_follow());
+        break;
+    case Command::toggle_wrap:
+        buffer.set_wrap(!buffer.get_wrap());
+        break;
+    case Command::next_buffer:
+        return InputResult::next_buffer;
+    case Command::prev_buffer:
+        return InputResult::prev_buffer;
+    case Command::frame_stats:
+        return InputResult::frame_stats;
+    case Command::text_stats:
+        return InputResult::text_stats;
+    case Command::memory_stats:
+        return InputResult::memory_stats;
+    case Command::digit_argument:
+    case Command::macro_record:
+    case Command::macro_play:
+        // Handled by the keyboard
+        break;
+
+    // Inside prompts
+    case Command::prompt_yes:
+        return answer_prompt(buffer, true);
+    case Command::prompt_no:
+        return answer_prompt(buffer, false);
+    case Command::prompt_all:
+        return show_prompt == PromptType::quit ? InputResult::prompt_all : InputResult::none;
+    case Command::prompt_abort:
+        return abort_prompt(buffer);
+    case Command::prompt_accept:
+        accept_prompt(buffer);
+        break;
+    case Command::prompt_insert:
+        prompt.insert(prompt.length(), 1, key);
+        break;
+    case Command::prompt_backspace:
+        if (prompt.length() > 0) {
+            prompt.erase(prompt.length() - 1, 1);
+        }
+        break;
+    case Command::prompt_clear:
+        prompt.clear();
+        break;
+    case Command::search_forward:
+        if (prompt.length() > 0) {
+            search_failed = !buffer.search_forward(prompt, search_mode);
+            search_found = !search_failed;
+        }
+        break;
+    case Command::search_backward:
+        if (prompt.length() > 0) {
+            search_failed = !buffer.search_backward(prompt, search_mode);
+            search_found = !search_failed;
+        }
+        break;
+    case Command::toggle_ignore_case:
+        search_mode.ignore_case = !search_mode.ignore_case;
+        break;
+    case Command::toggle_whole_word:
+        search_mode.whole_word = !search_mode.whole_word;
+        break;
+    case Command::replace_one:
+        if (!buffer.replace_match()) {
+            return abort_prompt(buffer);
+        }
+        break;
+    case Command::replace_skip:
+        if (!buffer.skip_match()) {
+            return abort_prompt(buffer);
+        }
+        break;
+    case Command::replace_rest:
+        buffer.replace_all();
+        return abort_prompt(buffer);
+    case Command::dismiss:
+        show_prompt = PromptType::none;
+        break;
+    }
+
+    return InputResult::none;
+}
+
+InputResult Keyboard::read_input(Buffer& buffer)
+{
+    int key;
+    bool is_alt;
+
+    // Keys act on the text as edited through other buffers of the file
+    buffer.catch_up();
+
+    // Keys that waited for the copy are handled first, one at a time
+    if (!queued.empty() && queued_for->can_edit()) {
+        std::tie(key, is_alt) = queued.front();
+        queued.erase(queued.begin());
+        return handle_key(key, is_alt, *queued_for);
+    }
+
+    std::tie(key, is_alt) = read_key(escape);
+
+    if (key == ERR) {
         return InputResult::none;
     }
 
-    // Command mode: keys a to z are reserved
-    // for special commands.
-    if (!buffer.get_edit_mode() && key >= 'a' && key <= 'z') {
-        if (key == 'a') {
-            if (is_alt) {
-                buffer.begin_of_buffer();
-            } else {
-                buffer.begin_of_line();
-            }
-        } else if (key == 'b') {
-            buffer.back_to_indentation();
-        } else if (key == 'd') {
-            if (is_alt) {
-                buffer.delete_word_forward();
-            } else {
-                buffer.delete_character_forward();
-            }
-        } else if (key == 'e') {
-            if (is_alt) {
-                buffer.end_of_buffer();
-            } else {
-                buffer.end_of_line();
-            }
-        } else if (key == 'f') {
-            buffer.set_edit_mode(true);
-        } else if (key == 'g') {
-            buffer.store_point_location();
-            prompt.clear();
-            show_prompt = PromptType::goline;
-        } else if (key == 'h') {
-            if (is_alt) {
-                buffer.delete_word_backward();
-            } else {
-                buffer.delete_character_backward();
-            }
-        } else if (key == 'i') {
-            if (is_alt) {
-                buffer.backward_paragraph();
-            } else {
-                buffer.backward_line();
-            }
-        } else if (key == 'j') {
-            if (is_alt) {
-                buffer.backward_word();
-            } else {
-                buffer.backward_character();
-            }
-        } else if (key == 'k') {
-            if (is_alt) {
-                buffer.forward_paragraph();
-            } else {
-                buffer.forward_line();
-            }
-        } else if (key == 'l') {
-            if (is_alt) {
-                buffer.forward_word();
-            } else {
-                buffer.forward_character();
-            }
-        } else if (key == 'n') {
-            return InputResult::next_buffer;
-        } else if (key == 'p') {
-            return InputResult::prev_buffer;
-        } else if (key == 'q') {
-            show_prompt = PromptType::quit;
-        } else if (key == 'r') {
-            buffer.scroll_current_line_middle();
-        } else if (key == 's') {
-            buffer.store_point_location();
-            prompt.clear();
-            show_prompt = PromptType::search;
-        } else if (key == 't') {
-            buffer.delete_rest_of_line();
-        } else if (key == 'v') {
-            if (is_alt) {
-                buffer.scroll_page_up();
-            } else {
-                buffer.scroll_page_down();
+    // Resize window
+    if (key == KEY_RESIZE) {
+        return InputResult::screen_size;
+    }
+
+    if (key < 0 || key >= num_keys) {
+        return InputResult::none;
+    }
+
+    if (!queued.empty()) {
+        queued.emplace_back(key, is_alt);
+        return InputResult::none;
+    }
+
+    return handle_key(key, is_alt, buffer);
+}
+
+InputResult Keyboard::handle_key(int key, bool is_alt, Buffer& buffer)
+{
+    auto command = keys[key_slot(key_mode(buffer), is_alt, key)];
+
+    // Edits during a save wait until the saver has copied the text,
+    // keys that come after them wait too. A replay takes the copy
+    // right away because it does not draw the screen anyway.
+    if (!replaying && changes_text(command) && !buffer.can_edit()) {
+        queued.emplace_back(key, is_alt);
+        queued_for = &buffer;
+        return InputResult::none;
+    }
+
+    if (command == Command::macro_record) {
+        if (!replaying) {
+            macro_recording = !macro_recording;
+
+            if (macro_recording) {
+                macro.clear();
             }
-        } else if (key == 'w') {
-            show_prompt = PromptType::write;
         }
-
         return InputResult::none;
     }
 
-    // Special keys
-    if (key == KEY_UP) {
-        if (is_alt) {
-            buffer.backward_paragraph();
-        } else {
-            buffer.backward_line();
+    if (macro_recording && command != Command::macro_play) {
+        macro.emplace_back(key, is_alt);
+    }
+
+    // Digits are collected into a repeat count for the next command
+    if (command == Command::digit_argument) {
+        if (key >= '0' && key <= '9' && repeat_count < max_repeat_count / 10) {
+            repeat_count = std::max(repeat_count, 0) * 10 + (key - '0');
         }
-    } else if (key == KEY_DOWN) {
-        if (is_alt) {
-            buffer.forward_paragraph();
-        } else {
-            buffer.forward_line();
+        return InputResult::none;
+    }
+
+    int count = repeat_count;
+    repeat_count = -1;
+
+    if (command == Command::macro_play) {
+        return play_macro(count < 0 ? 1 : count, buffer);
+    }
+
+    return run_command(command, key, std::max(count, 1), buffer);
+}
+
+// Replay the keys of the macro count times, or until a search fails
+// or the end of the buffer is reached if count is 0. A key pressed
+// during the replay stops it. Keys are handled without drawing the
+// screen, which is drawn once when the replay is done.
+InputResult Keyboard::play_macro(int count, Buffer& buffer)
+{
+    if (macro_recording || replaying || macro.empty()) {
+        return InputResult::none;
+    }
+
+    auto result = InputResult::none;
+    replaying = true;
+    search_failed = false;
+
+    for (int i = 0; (count == 0 || i < count) && !search_failed && result == InputResult::none; i++) {
+        auto version = buffer.get_version();
+        auto point = buffer.get_point();
+        auto line = buffer.current_line();
+        search_found = false;
+
+        for (auto [key, is_alt] : macro) {
+            result = handle_key(key, is_alt, buffer);
+
+            // Results such as switching buffers end the replay
+            if (search_failed || result != InputResult::none) {
+                break;
+            }
         }
-    } else if (key == KEY_LEFT) {
-        if (is_alt) {
-            buffer.backward_word();
-        } else {
-            buffer.backward_character();
+
+        // Macro that changed nothing would never stop
+        if (count == 0 && buffer.get_version() == version && buffer.get_point() == point) {
+            break;
         }
-    } else if (key == KEY_RIGHT) {
-        if (is_alt) {
-            buffer.forward_word();
-        } else {
-            buffer.forward_character();
+
+        // Motion stopped at the last line, editing would go on forever
+        if (count == 0 && !search_found && buffer.current_line() == line && line == buffer.num_of_lines() - 1) {
+            break;
         }
-    } else if (key == KEY_PPAGE) {
-        buffer.scroll_page_up();
-    } else if (key == KEY_NPAGE) {
-        buffer.scroll_page_down();
-    } else if (key == KEY_HOME) {
-        buffer.begin_of_line();
-    } else if (key == KEY_END) {
-        buffer.end_of_line();
-    } else if (key == KEY_DC) {
-        buffer.delete_character_forward();
-    } else if (key == KEY_BACKSPACE) {
-        if (is_alt) {
-            buffer.delete_word_backward();
-        } else {
-            buffer.delete_character_backward();
+
+        if (input_pending()) {
+            break;
         }
-    } else if (key == ',' && is_alt) {
-        buffer.scroll_left();
-    } else if (key == '.' && is_alt) {
-        buffer.scroll_right();
-    } else if (key == 10 || key == 13) {
-        buffer.insert_character('\n');
-    } else if (key == '\t') {
-        buffer.insert_character('\t');
-    } else if (is_printable_char(key)) {
-        // Printable characters
-        buffer.insert_character(key);
     }
 
-    return InputResult::none;
+    // Leave the search where the replay stopped
+    if (search_failed && show_prompt == PromptType::search) {
+        abort_prompt(buffer);
+    }
+
+    replaying = false;
+    return result;
 }
@@ -0,0 +1,114 @@
+#include "med.h"
+
+#include <algorithm>
+
+// Line operations work on views of the lines in the buffer, so the
+// text is not copied until the new content is built. Large inputs
+// are split into chunks that are handled by several threads.
+
+// Fewer lines than this are handled in the calling thread
+constexpr long min_parallel_lines = 64 * 1024;
+
+// Run work(chunk, begin, end) for chunks of n items, in parallel if
+// n is large. Returns the boundaries of the chunks, one more than
+// the number of chunks.
+template<typename Work>
+std::vector<long> parallel_chunks(long n, Work work)
+{
+    long count = 1;
+
+    if (n >= min_parallel_lines) {
+        count = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    std::vector<long> bounds;
+
+    for (long i = 0; i <= count; i++) {
+        bounds.push_back(n * i / count);
+    }
+
+    std::vector<std::thread> threads;
+
+    for (long i = 1; i < count; i++) {
+        threads.emplace_back(work, i, bounds[i], bounds[i + 1]);
+    }
+
+    work(0, bounds[0], bounds[1]);
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    return bounds;
+}
+
+// Sort chunks in parallel, then merge neighbouring chunks
+// in rounds until one sorted chunk is left
+void sort_lines(std::vector<std::string_view>& lines)
+{
+    auto bounds = parallel_chunks(lines.size(), [&](long, long begin, long end) {
+        std::sort(lines.begin() + begin, lines.begin() + end);
+    });
+
+    while (bounds.size() > 2) {
+        std::vector<long> merged;
+        std::vector<std::thread> threads;
+
+        for (std::size_t i = 0; i + 2 < bounds.size(); i += 2) {
+            threads.emplace_back([&lines, begin = bounds[i], middle = bounds[i + 1], end = bounds[i + 2]] {
+                std::inplace_merge(lines.begin() + begin, lines.begin() + middle, lines.begin() + end);
+            });
+            merged.push_back(bounds[i]);
+        }
+
+        // Odd chunk is merged in the next round
+        if (bounds.size() % 2 == 0) {
+            merged.push_back(bounds[bounds.size() - 2]);
+        }
+
+        merged.push_back(bounds.back());
+
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        bounds.swap(merged);
+    }
+}
+
+// Remove lines that are the same as the line before them
+void unique_lines(std::vector<std::string_view>& lines)
+{
+    lines.erase(std::unique(lines.begin(), lines.end()), lines.end());
+}
+
+// Keep the lines that contain pattern, or the lines
+// that do not if keep is false. Order is not changed.
+void filter_lines(std::vector<std::string_view>& lines, std::string_view pattern, bool keep)
+{
+    Searcher searcher(pattern, {});
+    std::vector<long> kept(std::max(1u, std::thread::hardware_concurrency()));
+
+    // Each chunk moves its kept lines to the start of the chunk
+    auto bounds = parallel_chunks(lines.size(), [&](long chunk, long begin, long end) {
+        long out = begin;
+
+        for (long i = begin; i < end; i++) {
+            if ((searcher.find(lines[i], 0) >= 0) == keep) {
+                lines[out++] = lines[i];
+            }
+        }
+
+        kept[chunk] = out - begin;
+    });
+
+    // Then the chunks are moved together
+    long out = 0;
+
+    for (std::size_t chunk = 0; chunk + 1 < bounds.size(); chunk++) {
+        auto begin = lines.begin() + bounds[chunk];
+        out = std::move(begin, begin + kept[chunk], lines.begin() + out) - lines.begin();
+    }
+
+    lines.resize(out);
+}
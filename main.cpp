@@ -1,15 +1,203 @@
 #include "med.h"
 
+#include <algorithm>
+#include <chrono>
 #include <clocale>
+#include <csignal>
+#include <unistd.h>
+
+extern std::vector<std::string> write_buffers(const std::vector<Buffer*>& buffers);
+extern std::string message;
+extern std::string format_bytes(long bytes);
+extern std::string format_memory(const MemoryStats& stats);
 
 PromptType show_prompt = PromptType::none;
 
+// Screen is drawn at most this often, input that arrives
+// in between is handled and shown in the next frame
+constexpr auto frame_interval = std::chrono::milliseconds(16);
+
+// Status bar is updated this often while files are being saved
+constexpr int save_progress_interval = 100;
+
+// Why waiting for events returned
+enum class Wakeup { input, change, timeout };
+
 void error(std::string_view txt)
 {
     std::cerr << txt << std::endl;
     exit(1);
 }
 
+// Buffers of the same file share the document of the first one,
+// so the file is saved and asked about only once
+bool shared_before(const std::vector<Buffer>& buffers, int index)
+{
+    return std::any_of(buffers.begin(), buffers.begin() + index, [&](const Buffer& buffer) {
+        return buffer.shares_document(buffers[index]);
+    });
+}
+
+// Change on disk is handled once for each document, by a buffer
+// that follows the file if there is one. Other buffers of the
+// document catch up with text that the follower read.
+void file_changed(std::vector<Buffer>& buffers, const std::string& path)
+{
+    std::vector<const Buffer*> handled;
+
+    for (auto& buffer : buffers) {
+        if (!Watcher::matches(path, buffer.get_filename())) {
+            continue;
+        }
+
+        auto same = [&](const Buffer* other) { return other->shares_document(buffer); };
+
+        if (std::any_of(handled.begin(), handled.end(), same)) {
+            continue;
+        }
+
+        handled.push_back(&buffer);
+
+        auto follower = std::find_if(buffers.begin(), buffers.end(), [&](const Buffer& other) {
+            return other.shares_document(buffer) && other.get_follow();
+        });
+
+        if (follower != buffers.end()) {
+            follower->file_changed();
+        } else {
+            buffer.file_changed();
+        }
+    }
+}
+
+// Memory used by each buffer and in total, printed on exit
+void print_memory_report(const std::vector<Buffer>& buffers, const Screen& screen)
+{
+    long total = screen.memory_usage();
+
+    for (int i = 0; i < static_cast<int>(buffers.size()); i++) {
+        bool shared = shared_before(buffers, i);
+        auto stats = buffers[i].memory_usage(!shared);
+        total += stats.text + stats.index + stats.caches + stats.journal;
+
+        std::cerr << buffers[i].get_filename() << ": " << format_memory(stats)
+                  << (shared ? " (text shared)" : "") << std::endl;
+    }
+
+    std::cerr << "screen " << format_bytes(screen.memory_usage()) << std::endl;
+    std::cerr << "total " << format_bytes(total) << std::endl;
+}
+
+// Save changed buffers starting from first, all at the same time.
+// Returns a summary of the results if any of them failed.
+std::string save_all(std::vector<Buffer>& buffers, int first)
+{
+    std::vector<Buffer*> changed;
+
+    for (int i = first; i < static_cast<int>(buffers.size()); i++) {
+        if (buffers[i].get_content_changed() && !shared_before(buffers, i)) {
+            buffers[i].finish_io();
+            changed.push_back(&buffers[i]);
+        }
+    }
+
+    auto errors = write_buffers(changed);
+
+    std::string saved;
+    std::string failed;
+
+    for (std::size_t i = 0; i < changed.size(); i++) {
+        if (errors[i].empty()) {
+            changed[i]->set_saved();
+            saved += " " + changed[i]->get_filename();
+        } else {
+            failed += " " + changed[i]->get_filename() + " (" + errors[i] + ")";
+        }
+    }
+
+    if (failed.empty()) {
+        return {};
+    }
+
+    return "Saved:" + (saved.empty() ? " none" : saved) + "  Failed:" + failed;
+}
+
+// Read a key and start waiting for the next one after ESC
+InputResult read_input(EventLoop& loop, Keyboard& keys, Buffer& buffer)
+{
+    auto input = keys.read_input(buffer);
+
+    if (keys.escape_pending()) {
+        loop.set_timer(escape_timeout);
+    }
+
+    return input;
+}
+
+// Handle events until there is keyboard input, something else
+// changed that must be drawn or timeout milliseconds have passed
+Wakeup wait_for_events(EventLoop& loop, Keyboard& keys, Screen& screen, Watcher& watcher,
+                       std::vector<Buffer>& buffers, int timeout = -1)
+{
+    if (keys.input_pending()) {
+        return Wakeup::input;
+    }
+
+    // Files that changed and compressed files that are still being loaded
+    std::vector<int> fds = { watcher.get_fd() };
+
+    for (const auto& buffer : buffers) {
+        if (buffer.get_load_fd() >= 0) {
+            fds.push_back(buffer.get_load_fd());
+        }
+    }
+
+    auto events = loop.wait(fds, timeout);
+
+    if (events.timeout) {
+        return Wakeup::timeout;
+    }
+
+    if (events.resize) {
+        screen.size_changed();
+    }
+
+    if (events.timer) {
+        keys.escape_timeout();
+    }
+
+    for (auto& buffer : buffers) {
+        buffer.check_save();
+    }
+
+    for (int fd : events.ready) {
+        if (fd == watcher.get_fd()) {
+            for (const auto& path : watcher.read_changes()) {
+                file_changed(buffers, path);
+            }
+        }
+
+        for (auto& buffer : buffers) {
+            if (buffer.get_load_fd() == fd) {
+                buffer.load_more();
+            }
+        }
+    }
+
+    return keys.input_pending() ? Wakeup::input : Wakeup::change;
+}
+
+// Wait for keyboard input in prompts that show the given buffer
+InputResult wait_for_input(EventLoop& loop, Keyboard& keys, Screen& screen, Watcher& watcher,
+                           std::vector<Buffer>& buffers, Buffer& buffer)
+{
+    while (wait_for_events(loop, keys, screen, watcher, buffers) != Wakeup::input) {
+        screen.draw(buffer);
+    }
+
+    return read_input(loop, keys, buffer);
+}
+
 int main(int argc, char *argv[])
 {
     // Use locale from environment
@@ -21,30 +209,98 @@ int main(int argc, char *argv[])
         error("Give filenames as arguments");
     }
 
+    // Writing to a compressor that failed must not kill us
+    signal(SIGPIPE, SIG_IGN);
+
+    // Created before any threads so they do not get the signals
+    EventLoop loop;
+
     std::vector<Buffer> buffers;
     int buffer_index = 0;
 
+    // Files after -x are shown in hex and files after -R are read-only
+    bool hex_mode = false;
+    bool read_only = false;
+    bool memory_report = false;
+
     for (int i = 1; i < argc; i++) {
+        if (std::string_view(argv[i]) == "-x") {
+            hex_mode = true;
+            continue;
+        } else if (std::string_view(argv[i]) == "-R") {
+            read_only = true;
+            continue;
+        } else if (std::string_view(argv[i]) == "--mem-report") {
+            memory_report = true;
+            continue;
+        }
+
+        auto same = std::find_if(buffers.begin(), buffers.end(), [&](const Buffer& buffer) {
+            return buffer.is_file(argv[i]);
+        });
+
         // emplace_back constructs object in-place and appends
         // it to the vector, avoiding copy or move operation
-        buffers.emplace_back(argv[i]);
+        if (same != buffers.end() && !hex_mode && !read_only) {
+            auto doc = same->get_document();
+            buffers.emplace_back(argv[i], doc);
+        } else {
+            buffers.emplace_back(argv[i], hex_mode, read_only);
+        }
     }
 
-    Screen screen;
+    if (buffers.empty()) {
+        error("Give filenames as arguments");
+    }
+
+    Watcher watcher;
+
+    for (const auto& buffer : buffers) {
+        watcher.add(buffer.get_filename());
+    }
+
+    // Keymap is read before the screen takes over the terminal
     Keyboard keys;
+    Screen screen;
+
+    // Offer to recover changes that were not saved
+    // when the editor was last closed
+    for (auto& buffer : buffers) {
+        if (buffer.can_recover()) {
+            show_prompt = PromptType::recover;
+        }
+
+        while (show_prompt == PromptType::recover) {
+            screen.draw(buffer);
+
+            auto input = wait_for_input(loop, keys, screen, watcher, buffers, buffer);
+
+            if (input == InputResult::screen_size) {
+                screen.size_changed();
+            } else if (input == InputResult::prompt_yes) {
+                buffer.recover();
+                show_prompt = PromptType::none;
+            } else if (input == InputResult::prompt_no) {
+                buffer.discard_journal();
+                show_prompt = PromptType::none;
+            }
+        }
+    }
 
     // Main loop
-    while (true) {
-        screen.draw(buffers[buffer_index]);
+    auto last_frame = std::chrono::steady_clock::time_point();
+    bool dirty = true;
 
+    while (true) {
         if (show_prompt == PromptType::quit) {
             bool quit_app = true;
+            message.clear();
 
             for (int i = 0; i < static_cast<int>(buffers.size()); ) {
-                if (buffers[i].get_content_changed()) {
+                if (buffers[i].get_content_changed() && !shared_before(buffers, i)) {
                     screen.draw(buffers[i]);
 
-                    auto input = keys.read_input(buffers[i]);
+                    auto input = wait_for_input(loop, keys, screen, watcher, buffers, buffers[i]);
 
                     if (input == InputResult::none) {
                         // Invalid input, do nothing
@@ -58,6 +314,14 @@ int main(int argc, char *argv[])
                         // Yes: save and go to next
                         buffers[i].write_file();
                         i++;
+                    } else if (input == InputResult::prompt_all) {
+                        // All: save this and the remaining buffers
+                        message = save_all(buffers, i);
+
+                        if (!message.empty()) {
+                            quit_app = false;
+                            break;
+                        }
                     } else if (input == InputResult::prompt_quit) {
                         // Cancel quit
                         quit_app = false;
@@ -69,29 +333,104 @@ int main(int argc, char *argv[])
                 }
             }
 
+            // Saves that failed leave a message and keep the editor open
+            if (quit_app) {
+                for (auto& buffer : buffers) {
+                    buffer.finish_save();
+                }
+
+                quit_app = message.empty();
+            }
+
             if (quit_app) {
+                // Changes the user chose not to save
+                for (auto& buffer : buffers) {
+                    if (buffer.get_content_changed()) {
+                        buffer.discard_journal();
+                    }
+                }
+
                 break;
             } else {
-                show_prompt = PromptType::none;
+                // Files that could not be saved are listed
+                show_prompt = message.empty() ? PromptType::none : PromptType::message;
             }
         } else {
-            InputResult input = keys.read_input(buffers[buffer_index]);
+            auto now = std::chrono::steady_clock::now();
+            int timeout = -1;
 
-            if (input == InputResult::screen_size) {
-                screen.size_changed();
-            } else if (input == InputResult::next_buffer) {
-                if (buffer_index < static_cast<int>(buffers.size()) - 1) {
-                    buffer_index++;
-                } else {
-                    buffer_index = 0;
-                }
-            } else if (input == InputResult::prev_buffer) {
-                if (buffer_index > 0) {
-                    buffer_index--;
-                } else {
-                    buffer_index = static_cast<int>(buffers.size()) - 1;
+            if (dirty && now - last_frame >= frame_interval) {
+                screen.draw(buffers[buffer_index]);
+                last_frame = now;
+                dirty = false;
+            } else if (dirty) {
+                // Too soon for the next frame
+                auto left = last_frame + frame_interval - now;
+                timeout = std::chrono::ceil<std::chrono::milliseconds>(left).count();
+            }
+
+            bool saving = std::any_of(buffers.begin(), buffers.end(), [](const Buffer& buffer) {
+                return buffer.save_progress() >= 0;
+            });
+
+            if (saving && timeout < 0) {
+                timeout = save_progress_interval;
+            }
+
+            auto wakeup = wait_for_events(loop, keys, screen, watcher, buffers, timeout);
+
+            if (wakeup == Wakeup::timeout) {
+                // Show save progress
+                dirty = dirty || saving;
+                continue;
+            }
+
+            if (wakeup == Wakeup::change) {
+                // Redraw for changes in files
+                if (dirty) {
+                    screen.frame_skipped();
                 }
+                dirty = true;
+                continue;
             }
+
+            // Handle all keys that have arrived before drawing again
+            do {
+                if (dirty) {
+                    screen.frame_skipped();
+                }
+                dirty = true;
+
+                InputResult input = read_input(loop, keys, buffers[buffer_index]);
+
+                if (input == InputResult::screen_size) {
+                    screen.size_changed();
+                } else if (input == InputResult::next_buffer) {
+                    if (buffer_index < static_cast<int>(buffers.size()) - 1) {
+                        buffer_index++;
+                    } else {
+                        buffer_index = 0;
+                    }
+                } else if (input == InputResult::prev_buffer) {
+                    if (buffer_index > 0) {
+                        buffer_index--;
+                    } else {
+                        buffer_index = static_cast<int>(buffers.size()) - 1;
+                    }
+                } else if (input == InputResult::frame_stats) {
+                    screen.toggle_stats();
+                } else if (input == InputResult::text_stats) {
+                    screen.toggle_text_stats();
+                } else if (input == InputResult::memory_stats) {
+                    screen.toggle_memory_stats();
+                }
+            } while (show_prompt != PromptType::quit && keys.input_pending());
         }
     }
+
+    // Printed when the terminal is back to normal
+    if (memory_report) {
+        screen.close();
+        print_memory_report(buffers, screen);
+    }
 }
@@ -0,0 +1,120 @@
+#include "med.h"
+
+#include <atomic>
+#include <csignal>
+#include <cstdint>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Mapped files may be truncated by other programs, for example
+// when logs are rotated. Reading a page past the new end raises
+// SIGBUS. The page is then replaced with zeros so the read can
+// go on, and the view maps the file again when it sees the change.
+constexpr int max_mappings = 64;
+
+struct MappedRange
+{
+    std::atomic<std::uintptr_t> start = 0;
+    std::atomic<std::uintptr_t> end = 0;
+};
+
+MappedRange mapped_ranges[max_mappings];
+long page_size = 0;
+
+void handle_sigbus(int, siginfo_t* info, void*)
+{
+    auto addr = reinterpret_cast<std::uintptr_t>(info->si_addr);
+
+    for (const auto& range : mapped_ranges) {
+        if (addr >= range.start && addr < range.end) {
+            auto page = reinterpret_cast<void*>(addr & ~static_cast<std::uintptr_t>(page_size - 1));
+
+            if (mmap(page, page_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+                return;
+            }
+        }
+    }
+
+    // Not a mapped file: crash as usual when the read is retried
+    signal(SIGBUS, SIG_DFL);
+}
+
+void guard_mappings()
+{
+    if (page_size > 0) {
+        return;
+    }
+
+    page_size = sysconf(_SC_PAGESIZE);
+
+    struct sigaction action = {};
+    action.sa_sigaction = handle_sigbus;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGBUS, &action, nullptr);
+}
+
+// Map the whole file for reading. Returns false if the file
+// cannot be opened or mapped, for example when it was just replaced.
+bool map_file(const std::string& filename, const char*& data, long& size)
+{
+    guard_mappings();
+
+    data = nullptr;
+    size = 0;
+
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+
+    if (fd < 0) {
+        return false;
+    }
+
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+
+    if (st.st_size > 0) {
+        void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+        if (map == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+
+        for (auto& range : mapped_ranges) {
+            if (range.start == 0) {
+                range.end = reinterpret_cast<std::uintptr_t>(map) + st.st_size;
+                range.start = reinterpret_cast<std::uintptr_t>(map);
+                break;
+            }
+        }
+
+        data = static_cast<const char*>(map);
+        size = st.st_size;
+    }
+
+    close(fd);
+    return true;
+}
+
+void unmap_file(const char* data, long size)
+{
+    if (!data) {
+        return;
+    }
+
+    auto start = reinterpret_cast<std::uintptr_t>(data);
+
+    for (auto& range : mapped_ranges) {
+        if (range.start == start) {
+            range.start = 0;
+            range.end = 0;
+        }
+    }
+
+    munmap(const_cast<char*>(data), size);
+}
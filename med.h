@@ -1,115 +1,769 @@
 #include <string>
 #include <vector>
+#include <unordered_map>
 #include <iostream>
+#include <memory>
+#include <functional>
+#include <map>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 
-enum class InputResult { none, next_buffer, prev_buffer, prompt_yes, prompt_no, prompt_quit, screen_size };
-enum class PromptType { none, goline, search, quit, write };
+// Tabs are drawn up to next multiple of this column
+constexpr int tab_size = 4;
+
+// Milliseconds to wait for the key after ESC before it is
+// taken as ESC alone instead of Alt combined with the key
+constexpr int escape_timeout = 100;
+
+enum class InputResult { none, next_buffer, prev_buffer, prompt_yes, prompt_no, prompt_all, prompt_quit, screen_size, frame_stats, text_stats, memory_stats };
+enum class Compression { none, gzip, zstd };
+enum class Syntax { none, c, json, log };
+enum class Highlight : unsigned char { normal, comment, string, keyword, number, preprocessor, error, warning, info, date, match };
+enum class PromptType { none, goline, search, quit, write, recover, reload, replace, replace_with, replace_query, lines, message };
+enum class LineOp { sort, unique, keep, flush };
+
+// Modes that have their own key bindings
+enum class KeyMode : unsigned char { command, edit, quit, recover, reload, write, goline, search, replace, replace_query, lines, message };
+
+// Commands that keys are bound to
+enum class Command : unsigned char {
+    none,
+    // Movement
+    begin_of_buffer, end_of_buffer, forward_character, backward_character,
+    forward_word, backward_word, forward_paragraph, backward_paragraph,
+    begin_of_line, end_of_line, forward_line, backward_line, back_to_indentation,
+    // Scrolling
+    scroll_left, scroll_right, scroll_current_line_middle, scroll_page_up, scroll_page_down,
+    // Editing
+    insert_char, insert_newline, insert_tab,
+    delete_character_forward, delete_character_backward,
+    delete_word_forward, delete_word_backward, delete_rest_of_line,
+    // Modes and prompts
+    edit_mode, command_mode, goto_line, search, replace, write, reload, quit,
+    toggle_follow, toggle_wrap, next_buffer, prev_buffer, frame_stats, text_stats, memory_stats, digit_argument,
+    macro_record, macro_play, set_mark, line_command,
+    // Inside prompts
+    prompt_yes, prompt_no, prompt_all, prompt_abort, prompt_accept,
+    prompt_insert, prompt_backspace, prompt_clear,
+    search_forward, search_backward, toggle_ignore_case, toggle_whole_word, replace_one, replace_skip, replace_rest, dismiss
+};
+
+// Append-only log of edits for recovering unsaved changes
+// after a crash. Records are collected in memory and written
+// to disk periodically by a background thread.
+class Journal
+{
+private:
+    std::string path;
+    int fd = -1;
+    bool failed = false;
+
+    std::string pending;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::thread writer;
+    bool stop = false;
+
+    void run();
+
+public:
+    // Called with operation, index, length and inserted text.
+    // Return false to stop the replay.
+    using ReplayFunc = std::function<bool(char, unsigned long, unsigned long, std::string_view)>;
+
+    ~Journal();
+
+    static std::string path_for(const std::string& filename);
+    static bool can_replay(const std::string& filename);
+    static void replay(const std::string& filename, const ReplayFunc& apply);
+
+    bool open(const std::string& filename, bool resume);
+    void close();
+    void discard();
+
+    void record_insert(long index, std::string_view txt);
+    void record_erase(long index, long len);
+    void record_file(const std::string& filename);
+    [[nodiscard]] long pending_bytes();
+};
+
+// Waits for keyboard input, window size changes, a timer,
+// workers finishing and other fds being readable
+class EventLoop
+{
+private:
+    int epoll_fd = -1;
+    int signal_fd = -1;
+    int timer_fd = -1;
+    std::vector<int> registered;
+
+public:
+    struct Events
+    {
+        bool input = false;
+        bool resize = false;
+        bool timer = false;
+        bool timeout = false;
+        std::vector<int> ready;
+    };
+
+    EventLoop();
+    ~EventLoop();
+
+    void set_timer(int ms);
+    Events wait(const std::vector<int>& fds, int timeout);
+};
+
+// Watches the directories of open files with inotify
+// and reports which files were changed
+class Watcher
+{
+private:
+    int fd = -1;
+    std::unordered_map<int, std::string> dirs;
+
+public:
+    Watcher();
+    ~Watcher();
+
+    [[nodiscard]] int get_fd() const;
+    void add(const std::string& filename);
+    std::vector<std::string> read_changes();
+
+    static bool matches(const std::string& path, const std::string& filename);
+};
+
+// How search text is matched
+struct SearchMode
+{
+    bool ignore_case = false; // ASCII letters only
+    bool whole_word = false;
+
+    bool operator==(const SearchMode&) const = default;
+};
+
+// Finds all matches of a pattern. The skip table is built
+// once and reused for every match.
+class Searcher
+{
+private:
+    std::string pattern;
+    SearchMode mode;
+    std::boyer_moore_horspool_searcher<const char*> searcher;
+
+    [[nodiscard]] long find_exact(std::string_view str, long from) const;
+    [[nodiscard]] long find_folded(std::string_view str, long from) const;
+    [[nodiscard]] bool is_whole_word(std::string_view str, long pos) const;
+
+public:
+    Searcher(std::string_view txt, SearchMode search_mode);
+    Searcher(const Searcher&) = delete;
+    Searcher& operator=(const Searcher&) = delete;
+
+    [[nodiscard]] long find(std::string_view str, long from) const;
+    [[nodiscard]] long find_last(std::string_view str, long from) const;
+    [[nodiscard]] long length() const;
+};
+
+// Counts matches of a pattern in a background thread. The text
+// must not change while counting: destroy the counter first.
+class MatchCounter
+{
+private:
+    std::string pattern;
+    SearchMode mode;
+    std::atomic<bool> cancelled = false;
+    std::atomic<long> count = -1;
+    std::thread worker;
+
+    void run(std::string_view text);
+
+public:
+    MatchCounter(std::string_view txt, SearchMode search_mode, std::string_view text);
+    ~MatchCounter();
+
+    [[nodiscard]] const std::string& get_pattern() const;
+    [[nodiscard]] SearchMode get_mode() const;
+    [[nodiscard]] long get_count() const;
+};
+
+// Writes text into a file in a background thread. The text must
+// stay unchanged until the save is done: the buffer gives the string
+// that owns it to keep() before it changes its content.
+class Saver
+{
+private:
+    std::string_view text;
+    std::string snapshot;
+    bool kept = false;
+    std::atomic<long> written = 0;
+    std::atomic<bool> done = false;
+    bool ok = false;
+    std::thread worker;
+
+    // Copy of the text for the buffer to edit, made in the background
+    std::string copy;
+    std::atomic<bool> copied = false;
+    std::thread copier;
+
+    void run(std::string filename, Compression compression);
+
+public:
+    Saver(std::string_view data, const std::string& filename, Compression compression);
+    ~Saver();
+
+    void wait();
+    void start_copy();
+    [[nodiscard]] bool copy_ready() const;
+    [[nodiscard]] std::string take_copy();
+    void keep(std::string&& content);
+    [[nodiscard]] bool keeps_content() const;
+    [[nodiscard]] long snapshot_bytes() const;
+    [[nodiscard]] std::string_view get_text() const;
+    [[nodiscard]] long get_written() const;
+    [[nodiscard]] bool is_done() const;
+    [[nodiscard]] bool succeeded() const;
+};
+
+// Shows a file as rows of bytes in hex. The file is mapped into
+// memory instead of read, and edited bytes are kept aside until
+// they are written back in place. The size of the file never changes.
+class HexView
+{
+private:
+    const unsigned char* data = nullptr;
+    long size = 0;
+
+    // Edited bytes by index
+    std::map<long, unsigned char> changed;
+
+    long point = 0;
+    bool low_nibble = false; // editing second digit of byte
+    long offset_row = 0;
+    int rows = 1;
+
+    bool map(const std::string& filename);
+    void unmap();
+    [[nodiscard]] long last_row() const;
+    void reconcile();
+
+public:
+    static constexpr int row_bytes = 16;
+
+    HexView(const std::string& filename);
+    ~HexView();
+    HexView(const HexView&) = delete;
+    HexView& operator=(const HexView&) = delete;
+
+    [[nodiscard]] long get_size() const;
+    [[nodiscard]] long get_point() const;
+    [[nodiscard]] long get_offset_row() const;
+    [[nodiscard]] int get_rows() const;
+    [[nodiscard]] bool get_low_nibble() const;
+    [[nodiscard]] bool has_changes() const;
+    [[nodiscard]] long changes_bytes() const;
+    [[nodiscard]] unsigned char byte_at(long index) const;
+    [[nodiscard]] bool is_changed(long index) const;
+
+    // Layout of rows on screen
+    [[nodiscard]] int offset_width() const;
+    [[nodiscard]] int byte_col(int i) const;
+    [[nodiscard]] int text_col() const;
+
+    bool remap(const std::string& filename);
+    void set_rows(int value);
+    void set_point(long value);
+    void move_rows(long delta);
+    void scroll_rows(long delta);
+    void center();
+    bool set_digit(int value);
+
+    [[nodiscard]] std::string write(const std::string& filename) const;
+    void clear_changes();
+};
+
+// Counts shown in the status bar
+struct TextStats
+{
+    long lines = 0;
+    long words = 0;
+    long bytes = 0;
+    long chars = 0;
+};
+
+// Bytes allocated for a buffer, taken from the
+// capacities of the containers that hold them
+struct MemoryStats
+{
+    long text = 0;
+    long index = 0;
+    long caches = 0;
+    long journal = 0;
+};
+
+// Point between tokens in a long line where lexing can resume
+struct LexPoint
+{
+    long offset; // from start of line
+    unsigned char state;
+};
+
+// Part of a line shown on one row of the screen
+struct ScreenRow
+{
+    int line;
+    long start; // start of line
+    long end; // end of line
+    long index; // first character shown
+    int col; // virtual column of index
+    int first_col; // virtual column at the left edge of the screen
+    long lex_start; // lexing starts here, at or before index
+    unsigned char state; // lexer state at lex_start
+};
+
+// Shows a file without reading it into memory. The file is mapped
+// and lines are found by scanning it from a known position. Starts
+// of every 1024th line are remembered as far as the view has gone,
+// so memory use stays small for any size of file.
+class TextView
+{
+private:
+    const char* data = nullptr;
+    long size = 0;
+
+    // Starts of lines 0, checkpoint_lines, 2 * checkpoint_lines...
+    // Line scanned_line starts at scanned and has not been scanned.
+    mutable std::vector<long> checkpoints;
+    mutable long scanned = 0;
+    mutable long scanned_line = 0;
+
+    // Counts of the whole file, found when first shown
+    mutable TextStats stats;
+    mutable bool counted = false;
+
+    // Long lines that were looked at, with the column at the start
+    // of each chunk and points to resume lexing from, so that the
+    // end of a long line is not found by scanning from its start
+    struct LongLine
+    {
+        struct Chunk
+        {
+            long index;
+            int col;
+        };
+
+        long start;
+        long end;
+        std::vector<Chunk> chunks;
+        std::vector<LexPoint> lex_points;
+    };
+
+    Syntax syntax;
+    mutable std::vector<LongLine> long_lines;
+
+    long point = 0;
+    long point_line = 0;
+    long previous_point = 0;
+    long top = 0; // start of first visible line
+    long top_line = 0;
+    int offset_col = 0;
+    int goal_col = 0;
+    int width = 1;
+    int rows = 1;
+
+    void scan_until(long index, long line) const;
+    [[nodiscard]] long count_lines(long from, long to) const;
+    [[nodiscard]] long line_number(long index) const;
+    [[nodiscard]] const LongLine* find_long_line(long index) const;
+    void add_long_line(long start, long end) const;
+    [[nodiscard]] long line_begin(long index) const;
+    [[nodiscard]] long line_finish(long index) const;
+    [[nodiscard]] long lines_forward(long start, long count, long& moved) const;
+    [[nodiscard]] long lines_backward(long start, long count, long& moved) const;
+    [[nodiscard]] int col_of(long index) const;
+    [[nodiscard]] long col_index(long start, int col) const;
+
+    void set_point(long value, bool set_goal);
+    void set_line(long start, long line, bool reconcile);
+    void scroll_lines(long delta);
+    void reconcile_by_moving_point();
+    void reconcile_by_scrolling();
+
+public:
+    TextView(const std::string& filename, Syntax syntax_type);
+    ~TextView();
+    TextView(const TextView&) = delete;
+    TextView& operator=(const TextView&) = delete;
+
+    [[nodiscard]] std::string_view get_text() const;
+    [[nodiscard]] long get_point() const;
+    [[nodiscard]] long current_line() const;
+    [[nodiscard]] int current_col() const;
+    [[nodiscard]] long get_top_line() const;
+    [[nodiscard]] int get_offset_col() const;
+    [[nodiscard]] std::vector<ScreenRow> visible_rows() const;
+    [[nodiscard]] TextStats get_stats() const;
+    [[nodiscard]] long cache_bytes() const;
+
+    void set_screen_size(int screen_width, int screen_height);
+    bool remap(const std::string& filename, bool appended);
+
+    // Movement
+    void begin_of_buffer();
+    void end_of_buffer();
+    void forward_character(int count);
+    void backward_character(int count);
+    void forward_word(int count);
+    void backward_word(int count);
+    void begin_of_line();
+    void end_of_line();
+    void back_to_indentation();
+    void forward_line(int count);
+    void backward_line(int count);
+    void goto_line(long line);
+    void store_point_location();
+    void restore_point_location();
+
+    // Scrolling
+    void scroll_left(int count);
+    void scroll_right(int count);
+    void scroll_current_line_middle();
+    void scroll_page_up(int count);
+    void scroll_page_down(int count);
+
+    // Searching
+    bool search_forward(std::string_view txt, SearchMode mode);
+    bool search_backward(std::string_view txt, SearchMode mode);
+};
+
+// Text of a file and everything that is derived from it. Buffers
+// of the same file share one document, so the text and its line
+// index are kept once and edits made in one buffer show in all.
+struct Document
+{
+    std::string content;
+    std::vector<long> line_indices;
+
+    // Incremented whenever content changes
+    unsigned long version = 0;
+
+    // Counted when content is read and updated on each edit
+    long word_count = 0;
+    long char_count = 0;
+
+    bool content_changed = false;
+    bool changed_on_disk = false;
+
+    // Identity of the file on disk when it was last read,
+    // used to notice appends, truncation and rotation
+    struct FileInfo
+    {
+        unsigned long device = 0;
+        unsigned long inode = 0;
+        long size = 0;
+        long mtime = 0; // nanoseconds
+
+        bool operator==(const FileInfo&) const = default;
+    };
+
+    FileInfo file_info;
+
+    // Compressed files are decompressed by a background process
+    // and read from a pipe while the editor is running
+    Compression compression = Compression::none;
+    int load_fd = -1;
+    int load_pid = -1;
+
+    // Checkpoints inside long lines so that columns can be
+    // located without scanning from the start of the line.
+    struct LineChunk
+    {
+        long index; // byte index in content
+        int col; // virtual (display) column
+    };
+
+    std::unordered_map<int, std::vector<LineChunk>> line_chunks;
+
+    // Points to resume lexing from inside long lines
+    std::unordered_map<int, std::vector<LexPoint>> lex_points;
+
+    // Opened on first edit
+    std::unique_ptr<Journal> journal;
+
+    // Syntax highlighting caches the lexer state at start of each
+    // line. States are known for lines before states_known. When
+    // dirty_line is not zero, lines from it to dirty_until changed
+    // and lines after keep their old states until lexing again
+    // gives the same state, after which the rest are valid too.
+    Syntax syntax = Syntax::none;
+    std::vector<unsigned char> line_states;
+    int states_known = 1;
+    int dirty_line = 0;
+    int dirty_until = 0;
+
+    // Total number of search matches
+    std::unique_ptr<MatchCounter> counter;
+
+    // Save in progress and content version that is being saved
+    std::unique_ptr<Saver> saver;
+    unsigned long saving_version = 0;
+
+    // Edits are logged while more than one buffer shows the
+    // document, so that the other buffers can move their point,
+    // mark and wrapped rows past them. Index -1 means that the
+    // whole content was replaced.
+    struct Edit
+    {
+        long index;
+        long removed;
+        long inserted;
+        int line;
+        int lines_removed;
+        int lines_added;
+    };
+
+    std::vector<Edit> edits;
+    long first_edit = 0; // number of edits dropped from the log
+    std::vector<long> edits_seen; // by each buffer
+};
 
 class Buffer
 {
 private:
+    using FileInfo = Document::FileInfo;
+    using LineChunk = Document::LineChunk;
+
     std::string filename;
-    std::string content;
+    std::shared_ptr<Document> doc;
+    int doc_view = 0; // index in doc->edits_seen
 
     int screen_width = 0;
     int screen_height = 0;
 
-    std::vector<int> line_indices;
+    // Binary file shown in hex instead of content
+    std::unique_ptr<HexView> hex;
+
+    // Opened with -R: editing is disabled, and the file is
+    // shown by a view instead of being read into content
+    bool read_only = false;
+    std::unique_ptr<TextView> view;
 
-    int point = 0;
-    int previous_point = 0;
+    long point = 0;
+    long previous_point = 0;
+    long mark = -1; // -1 if not set
     int offset_line = 0;
     int offset_col = 0; // virtual column
     int goal_col = 0; // virtual column
 
+    // Virtual columns are display columns: tabs extend to
+    // next tab stop, control characters are drawn as ^X and
+    // wide characters take two columns.
+
     bool edit_mode = false;
-    bool content_changed = false;
+    bool follow = false;
+
+    // Soft wrap: lines longer than the screen continue on the next
+    // rows. The rows of a line are found when it is first shown and
+    // kept by line number until the line is edited. The top of the
+    // screen is row offset_row of offset_line.
+    bool wrap = false;
+    int offset_row = 0;
+    mutable std::unordered_map<int, std::vector<LineChunk>> wrap_rows;
+
+    // Row of a wrapped line
+    struct VisualRow
+    {
+        int line;
+        int row;
+
+        auto operator<=>(const VisualRow&) const = default;
+    };
+
+    // Query-replace in progress
+    std::unique_ptr<Searcher> searcher;
+    std::string replacement;
 
     void update_line_indices();
+    void extend_line_indices(long from);
+    void replace_line_indices(long index, long old_len, long new_len);
+    void uncount_text(long index, long len);
+    void count_text(long index, long len);
+    [[nodiscard]] int line_of(long index) const;
+    void update_line_states(int upto) const;
+    [[nodiscard]] FileInfo stat_file() const;
+    void read_appended(long size);
+    void start_loading();
+    void finish_loading();
+    const std::vector<LineChunk>& chunks_of_line(int line) const;
+    const std::vector<LexPoint>& lex_points_of_line(int line) const;
+    [[nodiscard]] ScreenRow screen_row(int line, long index, int col, int first_col) const;
+    const std::vector<LineChunk>& rows_of_line(int line) const;
+    void shift_wrap_rows(int line, int removed, int added, long delta);
+    void log_edit(Document::Edit edit);
+    bool apply_logged_edits();
+    void clamp_positions();
+
+    // Visual rows
+    [[nodiscard]] VisualRow point_row() const;
+    [[nodiscard]] VisualRow top_row() const;
+    [[nodiscard]] VisualRow move_rows(VisualRow pos, long delta) const;
+    [[nodiscard]] int row_col() const;
+    void set_row(VisualRow pos, bool reconcile);
+    void scroll_rows(long delta);
 
     // Setters
-    void set_point(int value, bool reconcile, bool set_goal);
+    void set_point(long value, bool reconcile, bool set_goal);
     bool set_line(int line, bool reconcile);
     void set_offset_line(int value, bool reconcile);
     void set_offset_col(int value, bool reconcile);
 
+    // Edit primitives: all changes to content go through these
+    void insert_text(long index, std::string_view txt);
+    void erase_text(long index, long len);
+    void start_journal(bool resume);
+    void before_change();
+
     // Reconcialition
     void reconcile_by_moving_point();
     void reconcile_by_scrolling();
 
     // Search helpers
-    [[nodiscard]] int word_boundary_forward(int index) const;
-    [[nodiscard]] int word_boundary_backward(int index) const;
-    [[nodiscard]] int paragraph_boundary_forward(int index) const;
-    [[nodiscard]] int paragraph_boundary_backward(int index) const;
+    [[nodiscard]] long word_boundary_forward(long index) const;
+    [[nodiscard]] long word_boundary_backward(long index) const;
+    [[nodiscard]] long paragraph_boundary_forward(long index) const;
+    [[nodiscard]] long paragraph_boundary_backward(long index) const;
+    [[nodiscard]] long words_forward(long index, int count) const;
+    [[nodiscard]] long words_backward(long index, int count) const;
+    bool find_match(long from);
 
 public:
     // Constructor
-    Buffer(std::string fname);
+    Buffer(std::string fname, bool hex_mode, bool read_only_mode);
+    Buffer(std::string fname, std::shared_ptr<Document> document);
+
+    // Shared documents
+    [[nodiscard]] std::shared_ptr<Document> get_document() const;
+    [[nodiscard]] bool is_file(const std::string& fname) const;
+    [[nodiscard]] bool shares_document(const Buffer& other) const;
+    void catch_up();
 
     // I/O
     void read_file();
     void write_file();
+    void check_save();
+    void finish_save();
+    void finish_io();
+    [[nodiscard]] std::string write_content() const;
+    void set_saved();
+    void load_more();
+    [[nodiscard]] int get_load_fd() const;
+
+    // Changes on disk
+    void file_changed();
+    void reload();
+
+    // Crash recovery
+    [[nodiscard]] bool can_recover() const;
+    void recover();
+    void discard_journal();
 
     // Getters
     [[nodiscard]] std::string get_filename() const;
     [[nodiscard]] std::string_view get_content() const;
-    [[nodiscard]] int get_point() const;
+    [[nodiscard]] long get_point() const;
     [[nodiscard]] int num_of_lines() const;
-    [[nodiscard]] int line_start(int line) const;
-    [[nodiscard]] int line_end(int line) const;
+    [[nodiscard]] long line_start(int line) const;
+    [[nodiscard]] long line_end(int line) const;
     [[nodiscard]] int current_line() const;
     [[nodiscard]] int current_real_col() const;
     [[nodiscard]] int current_virtual_col() const;
+    [[nodiscard]] int line_length_cols(int line) const;
+    [[nodiscard]] long col_to_index(int line, int col) const;
+    [[nodiscard]] int index_to_col(int line, long index) const;
     [[nodiscard]] int get_offset_line() const;
     [[nodiscard]] int get_offset_col() const;
     [[nodiscard]] bool get_edit_mode() const;
     [[nodiscard]] bool get_content_changed() const;
+    [[nodiscard]] bool get_follow() const;
+    [[nodiscard]] bool get_wrap() const;
+    [[nodiscard]] int get_offset_row() const;
+    [[nodiscard]] std::vector<ScreenRow> visible_rows() const;
+    [[nodiscard]] Syntax get_syntax() const;
+    [[nodiscard]] unsigned char line_state(int line) const;
+    [[nodiscard]] bool get_changed_on_disk() const;
+    [[nodiscard]] unsigned long get_version() const;
+    [[nodiscard]] int save_progress() const;
+    [[nodiscard]] long get_mark() const;
+    [[nodiscard]] HexView* get_hex() const;
+    [[nodiscard]] TextView* get_view() const;
+    [[nodiscard]] bool get_read_only() const;
+    [[nodiscard]] bool can_edit();
+    [[nodiscard]] TextStats get_stats() const;
+    [[nodiscard]] TextStats region_stats() const;
+    [[nodiscard]] MemoryStats memory_usage(bool with_document) const;
 
     // Setters
     void set_screen_size(int width, int height);
     void set_edit_mode(bool value);
+    void set_follow(bool value);
+    void set_wrap(bool value);
     void store_point_location();
     void restore_point_location();
+    void set_mark();
+    void set_hex_digit(int value);
 
     // Movement
     void begin_of_buffer();
     void end_of_buffer();
-    void forward_character();
-    void backward_character();
-    void forward_word();
-    void backward_word();
-    void forward_paragraph();
-    void backward_paragraph();
+    void forward_character(int count);
+    void backward_character(int count);
+    void forward_word(int count);
+    void backward_word(int count);
+    void forward_paragraph(int count);
+    void backward_paragraph(int count);
     void begin_of_line();
     void end_of_line();
-    void forward_line();
-    void backward_line();
+    void forward_line(int count);
+    void backward_line(int count);
     void back_to_indentation();
     void goto_line(int line);
 
     // Scrolling
     void scroll_up();
     void scroll_down();
-    void scroll_left();
-    void scroll_right();
+    void scroll_left(int count);
+    void scroll_right(int count);
     void scroll_current_line_middle();
-    void scroll_page_up();
-    void scroll_page_down();
+    void scroll_page_up(int count);
+    void scroll_page_down(int count);
 
     // Edit: insertion
-    void insert_character(char c);
+    void insert_character(std::string_view c, int count);
 
     // Edit: deletion
-    void delete_character_forward();
-    void delete_character_backward();
-    void delete_word_forward();
-    void delete_word_backward();
-    void delete_rest_of_line();
+    void delete_character_forward(int count);
+    void delete_character_backward(int count);
+    void delete_word_forward(int count);
+    void delete_word_backward(int count);
+    void delete_rest_of_line(int count);
 
     // Searching
-    bool search_forward(std::string_view txt);
-    bool search_backward(std::string_view txt);
+    bool search_forward(std::string_view txt, SearchMode mode);
+    bool search_backward(std::string_view txt, SearchMode mode);
+    void count_matches(std::string_view txt, SearchMode mode);
+    [[nodiscard]] long match_count() const;
+
+    // Replacing
+    bool start_replace(std::string_view from, std::string_view to);
+    bool replace_match();
+    bool skip_match();
+    long replace_all();
+    void stop_replace();
+
+    // Line operations
+    long transform_lines(LineOp op, std::string_view pattern);
 };
 
 class Screen
@@ -117,9 +771,22 @@ class Screen
 private:
     bool redraw_screen = false;
 
+    // Frames drawn and changes that were shown
+    // in a later frame instead of their own
+    bool show_stats = false;
+    long frames = 0;
+    long skipped = 0;
+
+    // Counts of lines, words, bytes and characters
+    bool show_text_stats = false;
+
+    // Memory used by the buffer
+    bool show_memory_stats = false;
+
     void draw_buffer(const Buffer& buffer);
+    void draw_hex(const HexView& hex);
     void draw_statusbar(const Buffer& buffer);
-    void draw_minibuffer();
+    void draw_minibuffer(const Buffer& buffer);
     void draw_cursor(const Buffer& buffer);
 
 public:
@@ -127,13 +794,37 @@ public:
     ~Screen();
 
     void draw(Buffer& buffer);
+    void close();
     void size_changed();
+    void frame_skipped();
+    void toggle_stats();
+    void toggle_text_stats();
+    void toggle_memory_stats();
+    [[nodiscard]] long memory_usage() const;
 };
 
 class Keyboard
 {
 private:
+    // ESC was read but the key after it has not arrived yet
+    bool escape = false;
+
+    // Keys of the recorded macro and whether it is being replayed
+    std::vector<std::pair<int, bool>> macro;
+    bool replaying = false;
+
+    // Keys that arrived while an edit waited for a save to copy the text
+    std::vector<std::pair<int, bool>> queued;
+    Buffer* queued_for = nullptr;
+
+    InputResult handle_key(int key, bool is_alt, Buffer& buffer);
+    InputResult play_macro(int count, Buffer& buffer);
 
 public:
+    Keyboard();
+
+    bool input_pending();
+    [[nodiscard]] bool escape_pending() const;
+    void escape_timeout();
     InputResult read_input(Buffer& buffer);
 };
@@ -0,0 +1,181 @@
+#include "med.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+
+extern bool write_compressed(Compression compression, const std::string& filename,
+                             std::string_view data, std::atomic<long>& written);
+extern void wake_event_loop();
+
+// Number of files that are written at the same time when saving all
+constexpr unsigned int max_save_threads = 4;
+
+bool write_plain(const std::string& filename, std::string_view text, std::atomic<long>& written)
+{
+    constexpr long chunk = 1024 * 1024;
+
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    long size = static_cast<long>(text.size());
+
+    while (written < size) {
+        auto n = write(fd, text.data() + written, std::min(chunk, size - written));
+
+        if (n <= 0) {
+            break;
+        }
+
+        written += n;
+    }
+
+    return close(fd) == 0 && written == size;
+}
+
+// Write text into file, compressing it if needed.
+// Bytes written so far are stored in written.
+bool write_text(const std::string& filename, Compression compression,
+                std::string_view text, std::atomic<long>& written)
+{
+    if (compression != Compression::none) {
+        return write_compressed(compression, filename, text, written);
+    }
+
+    return write_plain(filename, text, written);
+}
+
+// Write buffers into their files using a few threads. Returns
+// an error message for each buffer, empty if it was written.
+std::vector<std::string> write_buffers(const std::vector<Buffer*>& buffers)
+{
+    std::vector<std::string> errors(buffers.size());
+    std::atomic<std::size_t> next = 0;
+
+    auto work = [&] {
+        for (auto i = next++; i < buffers.size(); i = next++) {
+            errors[i] = buffers[i]->write_content();
+        }
+    };
+
+    auto count = std::min({ max_save_threads,
+                            std::max(1u, std::thread::hardware_concurrency()),
+                            static_cast<unsigned int>(buffers.size()) });
+
+    std::vector<std::thread> threads;
+
+    for (unsigned int i = 0; i < count; i++) {
+        threads.emplace_back(work);
+    }
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    return errors;
+}
+
+// Start writing text into file in the background
+Saver::Saver(std::string_view data, const std::string& filename, Compression compression) :
+    text(data)
+{
+    worker = std::thread(&Saver::run, this, filename, compression);
+}
+
+Saver::~Saver()
+{
+    wait();
+}
+
+// Wait until the file has been written
+void Saver::wait()
+{
+    if (worker.joinable()) {
+        worker.join();
+    }
+
+    if (copier.joinable()) {
+        copier.join();
+    }
+}
+
+// Start copying the text so that the buffer can be edited during
+// the save. Copying a large file takes a while, so it is done in
+// a thread and the editor stays responsive meanwhile.
+void Saver::start_copy()
+{
+    if (!copier.joinable() && !copied) {
+        copier = std::thread([this] {
+            copy = std::string(text);
+            copied = true;
+            wake_event_loop();
+        });
+    }
+}
+
+bool Saver::copy_ready() const
+{
+    return copied;
+}
+
+// Wait for the copy, starting it now if needed
+std::string Saver::take_copy()
+{
+    start_copy();
+
+    if (copier.joinable()) {
+        copier.join();
+    }
+
+    return std::move(copy);
+}
+
+// Take the string that owns the text being written, so that
+// the buffer can change the copy during the save. Moving
+// keeps the same memory so the writer is not disturbed.
+void Saver::keep(std::string&& content)
+{
+    snapshot = std::move(content);
+    kept = true;
+}
+
+bool Saver::keeps_content() const
+{
+    return kept;
+}
+
+// Copy of the text that is kept while the buffer changes
+long Saver::snapshot_bytes() const
+{
+    return snapshot.capacity();
+}
+
+std::string_view Saver::get_text() const
+{
+    return text;
+}
+
+long Saver::get_written() const
+{
+    return written;
+}
+
+bool Saver::is_done() const
+{
+    return done;
+}
+
+bool Saver::succeeded() const
+{
+    return ok;
+}
+
+void Saver::run(std::string filename, Compression compression)
+{
+    ok = write_text(filename, compression, text, written);
+    done = true;
+    wake_event_loop();
+}
@@ -0,0 +1,267 @@
+#include "med.h"
+
+#include <algorithm>
+#include <array>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+extern void wake_event_loop();
+extern bool is_word_char(std::string_view str, long index, long end, int& len);
+extern long char_start(std::string_view str, long index);
+
+// ASCII letters in lower case
+constexpr std::array<char, 256> make_fold_table()
+{
+    std::array<char, 256> table {};
+
+    for (int c = 0; c < 256; c++) {
+        table[c] = static_cast<char>(c >= 'A' && c <= 'Z' ? c + 32 : c);
+    }
+
+    return table;
+}
+
+constexpr auto fold_table = make_fold_table();
+
+constexpr char fold(char c)
+{
+    return fold_table[static_cast<unsigned char>(c)];
+}
+
+#ifdef __SSE2__
+// Lower case ASCII letters of 16 bytes. Bytes above 127
+// are negative so they are never taken as letters.
+__m128i fold16(__m128i v)
+{
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+                                  _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+    return _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+#endif
+
+// Compare len bytes of text with a folded pattern ignoring case
+bool equal_folded(const char* text, const char* pattern, long len)
+{
+    long i = 0;
+
+#ifdef __SSE2__
+    for (; i + 16 <= len; i += 16) {
+        __m128i a = fold16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i)));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pattern + i));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) != 0xFFFF) {
+            return false;
+        }
+    }
+#endif
+
+    for (; i < len; i++) {
+        if (fold(text[i]) != pattern[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Pattern is stored folded when case is ignored
+std::string fold_pattern(std::string_view txt, SearchMode mode)
+{
+    std::string result(txt);
+
+    if (mode.ignore_case) {
+        std::transform(result.begin(), result.end(), result.begin(), fold);
+    }
+
+    return result;
+}
+
+Searcher::Searcher(std::string_view txt, SearchMode search_mode) :
+    pattern(fold_pattern(txt, search_mode)),
+    mode(search_mode),
+    searcher(pattern.data(), pattern.data() + pattern.size())
+{
+}
+
+long Searcher::find_exact(std::string_view str, long from) const
+{
+    auto end = str.data() + str.size();
+    auto found = searcher(str.data() + from, end).first;
+
+    return found == end ? -1 : found - str.data();
+}
+
+// Candidates are the positions where the first and last byte of
+// the pattern match, 16 positions at a time. Only those are
+// compared with the whole pattern.
+long Searcher::find_folded(std::string_view str, long from) const
+{
+    const char* data = str.data();
+    long len = static_cast<long>(pattern.size());
+    long last = static_cast<long>(str.size()) - len;
+    long i = from;
+
+    if (len == 0) {
+        return from;
+    }
+
+#ifdef __SSE2__
+    __m128i first_byte = _mm_set1_epi8(pattern[0]);
+    __m128i last_byte = _mm_set1_epi8(pattern[len - 1]);
+
+    for (; i + 15 <= last; i += 16) {
+        __m128i a = fold16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i)));
+        __m128i b = fold16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + len - 1)));
+        unsigned int candidates = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first_byte),
+                                                                  _mm_cmpeq_epi8(b, last_byte)));
+
+        while (candidates) {
+            long pos = i + __builtin_ctz(candidates);
+
+            if (equal_folded(data + pos, pattern.data(), len)) {
+                return pos;
+            }
+
+            candidates &= candidates - 1;
+        }
+    }
+#endif
+
+    for (; i <= last; i++) {
+        if (fold(data[i]) == pattern[0] && equal_folded(data + i, pattern.data(), len)) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Match is not part of a longer word
+bool Searcher::is_whole_word(std::string_view str, long pos) const
+{
+    long end = static_cast<long>(str.size());
+    long after = pos + static_cast<long>(pattern.size());
+    int len;
+
+    if (pos > 0 && is_word_char(str, char_start(str, pos - 1), end, len)) {
+        return false;
+    }
+
+    return after >= end || !is_word_char(str, after, end, len);
+}
+
+// Index of the first match at or after from, or -1
+long Searcher::find(std::string_view str, long from) const
+{
+    while (from <= static_cast<long>(str.size())) {
+        long pos = mode.ignore_case ? find_folded(str, from) : find_exact(str, from);
+
+        if (pos < 0 || !mode.whole_word || is_whole_word(str, pos)) {
+            return pos;
+        }
+
+        from = pos + 1;
+    }
+
+    return -1;
+}
+
+// Index of the last match that starts at or before from, or -1.
+// Text is searched forward in windows going backward from there.
+long Searcher::find_last(std::string_view str, long from) const
+{
+    constexpr long window = 64 * 1024;
+
+    long size = static_cast<long>(str.size());
+    long len = static_cast<long>(pattern.size());
+    long end = std::min(from, size);
+
+    while (end >= 0) {
+        long start = std::max(0L, end - window);
+
+        // Room for the match and the character after it
+        auto part = str.substr(0, std::min(size, end + len + 4));
+        long found = -1;
+
+        for (long pos = find(part, start); pos >= 0 && pos <= end; pos = find(part, pos + 1)) {
+            found = pos;
+        }
+
+        if (found >= 0 || start == 0) {
+            return found;
+        }
+
+        end = start - 1;
+    }
+
+    return -1;
+}
+
+long Searcher::length() const
+{
+    return pattern.size();
+}
+
+// Start counting matches of txt in text
+MatchCounter::MatchCounter(std::string_view txt, SearchMode search_mode, std::string_view text) :
+    pattern(txt),
+    mode(search_mode)
+{
+    worker = std::thread(&MatchCounter::run, this, text);
+}
+
+// Cancel counting if it is not done yet
+MatchCounter::~MatchCounter()
+{
+    cancelled = true;
+    worker.join();
+}
+
+// Text is searched in chunks so that cancelling is noticed quickly
+void MatchCounter::run(std::string_view text)
+{
+    constexpr long chunk = 1024 * 1024;
+
+    Searcher searcher(pattern, mode);
+    long len = searcher.length();
+    long size = static_cast<long>(text.size());
+    long total = 0;
+    long next = 0; // matches do not overlap
+
+    for (long start = 0; start < size; start += chunk) {
+        if (cancelled) {
+            return;
+        }
+
+        // Matches must start inside the chunk but may end after it,
+        // and the character after a match decides if it is a word
+        long end = std::min(start + chunk, size);
+        auto part = text.substr(0, std::min(end + len + 3, size));
+
+        for (long pos = searcher.find(part, std::max(start, next)); pos >= 0 && pos < end; ) {
+            total++;
+            next = pos + len;
+            pos = searcher.find(part, next);
+        }
+    }
+
+    count = total;
+    wake_event_loop();
+}
+
+const std::string& MatchCounter::get_pattern() const
+{
+    return pattern;
+}
+
+SearchMode MatchCounter::get_mode() const
+{
+    return mode;
+}
+
+long MatchCounter::get_count() const
+{
+    return count;
+}
@@ -0,0 +1,325 @@
+#include "med.h"
+
+#include <algorithm>
+#include <array>
+#include <filesystem>
+
+// Lexers work one line at a time. The state at the start of a line
+// is all they need to know about the lines before it, which lets the
+// buffer cache the states and re-lex only lines that changed. Long
+// lines can also be lexed from a point between tokens, so drawing
+// the end of a line does not lex the whole line.
+
+// States between lines
+constexpr unsigned char state_normal = 0;
+constexpr unsigned char state_comment = 1; // inside /* */
+
+constexpr std::array<std::string_view, 58> c_keywords = {
+    "alignas", "alignof", "auto", "bool", "break", "case", "catch", "char",
+    "class", "const", "constexpr", "continue", "default", "delete", "do",
+    "double", "else", "enum", "explicit", "extern", "false", "float", "for",
+    "friend", "goto", "if", "inline", "int", "long", "namespace", "new",
+    "noexcept", "nullptr", "operator", "private", "protected", "public",
+    "return", "short", "signed", "sizeof", "static", "struct", "switch",
+    "template", "this", "throw", "true", "try", "typedef", "typename",
+    "union", "unsigned", "using", "virtual", "void", "volatile", "while"
+};
+
+static_assert(std::is_sorted(c_keywords.begin(), c_keywords.end()));
+
+// Choose syntax from the file name
+Syntax detect_syntax(const std::string& filename)
+{
+    auto path = std::filesystem::path(filename);
+
+    // Look through compression suffix
+    if (path.extension() == ".gz" || path.extension() == ".zst") {
+        path = path.stem();
+    }
+
+    auto ext = path.extension().string();
+
+    if (ext == ".c" || ext == ".h" || ext == ".cc" || ext == ".cpp" ||
+        ext == ".cxx" || ext == ".hh" || ext == ".hpp") {
+        return Syntax::c;
+    } else if (ext == ".json") {
+        return Syntax::json;
+    } else if (ext == ".log" || path.string().find(".log.") != std::string::npos) {
+        return Syntax::log;
+    }
+
+    return Syntax::none;
+}
+
+constexpr bool is_ident_char(char c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+        (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+constexpr bool is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+// Highlights of the bytes of a line from base on. Data may be
+// null when only the end state is needed.
+struct Colors
+{
+    unsigned char* data;
+    long base;
+};
+
+void paint(Colors colors, long from, long to, Highlight hl)
+{
+    if (colors.data && to > colors.base) {
+        std::fill(colors.data + std::max(from, colors.base) - colors.base,
+                  colors.data + to - colors.base, static_cast<unsigned char>(hl));
+    }
+}
+
+// Lexers call this between tokens and it records a point to resume
+// from when interval bytes have passed since the previous one
+struct LexPoints
+{
+    std::vector<LexPoint>* points;
+    long interval;
+
+    void reached(long i, unsigned char state) const
+    {
+        if (points && (points->empty() ? i >= interval : i >= points->back().offset + interval)) {
+            points->push_back({ i, state });
+        }
+    }
+};
+
+// Index after the string or character literal starting at i
+long skip_quoted(std::string_view line, long i)
+{
+    char quote = line[i++];
+
+    while (i < static_cast<long>(line.size())) {
+        if (line[i] == '\\') {
+            i += 2;
+        } else if (line[i++] == quote) {
+            break;
+        }
+    }
+
+    return std::min(i, static_cast<long>(line.size()));
+}
+
+unsigned char lex_c(std::string_view line, LexPoint from, Colors colors, const LexPoints& points)
+{
+    long len = static_cast<long>(line.size());
+    long i = from.offset;
+    unsigned char state = from.state;
+
+    // Preprocessor directive
+    auto first = line.find_first_not_of(" \t");
+    if (i == 0 && state == state_normal && first != std::string_view::npos && line[first] == '#') {
+        i = first + 1;
+        while (i < len && is_ident_char(line[i])) {
+            i++;
+        }
+        paint(colors, first, i, Highlight::preprocessor);
+    }
+
+    while (i < len) {
+        points.reached(i, state);
+
+        if (state == state_comment) {
+            auto found = line.find("*/", i);
+            long end = len;
+
+            if (found != std::string_view::npos) {
+                end = found + 2;
+                state = state_normal;
+            }
+
+            paint(colors, i, end, Highlight::comment);
+            i = end;
+            continue;
+        }
+
+        char c = line[i];
+
+        if (c == '/' && i + 1 < len && line[i + 1] == '/') {
+            paint(colors, i, len, Highlight::comment);
+            break;
+        } else if (c == '/' && i + 1 < len && line[i + 1] == '*') {
+            paint(colors, i, i + 2, Highlight::comment);
+            state = state_comment;
+            i += 2;
+        } else if (c == '"' || c == '\'') {
+            long end = skip_quoted(line, i);
+            paint(colors, i, end, Highlight::string);
+            i = end;
+        } else if (is_digit(c)) {
+            long end = i;
+            while (end < len && (is_ident_char(line[end]) || line[end] == '.' || line[end] == '\'')) {
+                end++;
+            }
+            paint(colors, i, end, Highlight::number);
+            i = end;
+        } else if (is_ident_char(c)) {
+            long end = i;
+            while (end < len && is_ident_char(line[end])) {
+                end++;
+            }
+
+            auto word = line.substr(i, end - i);
+            if (std::binary_search(c_keywords.begin(), c_keywords.end(), word)) {
+                paint(colors, i, end, Highlight::keyword);
+            }
+            i = end;
+        } else {
+            i++;
+        }
+    }
+
+    return state;
+}
+
+unsigned char lex_json(std::string_view line, LexPoint from, Colors colors, const LexPoints& points)
+{
+    long len = static_cast<long>(line.size());
+    long i = from.offset;
+
+    while (i < len) {
+        points.reached(i, state_normal);
+
+        char c = line[i];
+
+        if (c == '"') {
+            long end = skip_quoted(line, i);
+
+            // Keys are strings followed by a colon
+            auto next = line.find_first_not_of(" \t", end);
+            bool key = next != std::string_view::npos && line[next] == ':';
+
+            paint(colors, i, end, key ? Highlight::keyword : Highlight::string);
+            i = end;
+        } else if (is_digit(c) || c == '-') {
+            long end = i + 1;
+            while (end < len && (is_digit(line[end]) || line[end] == '.' ||
+                                 line[end] == 'e' || line[end] == 'E' ||
+                                 line[end] == '+' || line[end] == '-')) {
+                end++;
+            }
+            paint(colors, i, end, Highlight::number);
+            i = end;
+        } else if (line.substr(i).starts_with("true") || line.substr(i).starts_with("false") ||
+                   line.substr(i).starts_with("null")) {
+            long end = i + (c == 'f' ? 5 : 4);
+            paint(colors, i, end, Highlight::number);
+            i = end;
+        } else {
+            i++;
+        }
+    }
+
+    return state_normal;
+}
+
+// Highlight for a log level word, or normal if it is not one
+Highlight log_level(std::string_view word)
+{
+    if (word == "ERROR" || word == "FATAL" || word == "CRITICAL" || word == "CRIT" ||
+        word == "error" || word == "fatal") {
+        return Highlight::error;
+    } else if (word == "WARN" || word == "WARNING" || word == "warn" || word == "warning") {
+        return Highlight::warning;
+    } else if (word == "INFO" || word == "NOTICE" || word == "info") {
+        return Highlight::info;
+    } else if (word == "DEBUG" || word == "TRACE" || word == "debug" || word == "trace") {
+        return Highlight::comment;
+    }
+
+    return Highlight::normal;
+}
+
+unsigned char lex_log(std::string_view line, LexPoint from, Colors colors, const LexPoints& points)
+{
+    long len = static_cast<long>(line.size());
+    long i = from.offset;
+
+    // Timestamp at start of line: digits with date and time separators
+    while (from.offset == 0 && i < len && (is_digit(line[i]) || line[i] == '-' || line[i] == ':' ||
+                       line[i] == '.' || line[i] == '/' || line[i] == 'T' ||
+                       line[i] == 'Z' || line[i] == '+' ||
+                       (line[i] == ' ' && i + 1 < len && is_digit(line[i + 1])))) {
+        i++;
+    }
+
+    // Must contain at least a time to count as timestamp
+    if (from.offset > 0) {
+        // Resumed after the timestamp
+    } else if (line.substr(0, i).find(':') != std::string_view::npos) {
+        paint(colors, 0, i, Highlight::date);
+    } else {
+        i = 0;
+    }
+
+    while (i < len) {
+        points.reached(i, state_normal);
+
+        char c = line[i];
+
+        if (c == '"') {
+            long end = skip_quoted(line, i);
+            paint(colors, i, end, Highlight::string);
+            i = end;
+        } else if (is_ident_char(c)) {
+            long end = i;
+            while (end < len && is_ident_char(line[end])) {
+                end++;
+            }
+            paint(colors, i, end, log_level(line.substr(i, end - i)));
+            i = end;
+        } else {
+            i++;
+        }
+    }
+
+    return state_normal;
+}
+
+unsigned char lex(Syntax syntax, std::string_view line, LexPoint from, Colors colors, const LexPoints& points)
+{
+    paint(colors, from.offset, line.size(), Highlight::normal);
+
+    if (syntax == Syntax::c) {
+        return lex_c(line, from, colors, points);
+    } else if (syntax == Syntax::json) {
+        return lex_json(line, from, colors, points);
+    } else if (syntax == Syntax::log) {
+        return lex_log(line, from, colors, points);
+    }
+
+    return state_normal;
+}
+
+// Lex one line starting in given state and return the state at its
+// end. Highlights for each byte are written to colors if not null.
+unsigned char lex_line(Syntax syntax, std::string_view line, unsigned char state, unsigned char* colors)
+{
+    return lex(syntax, line, { 0, state }, { colors, 0 }, { nullptr, 0 });
+}
+
+// Lex line from a point returned by lex_points. Highlights of the
+// bytes from base on are written to colors, base must not be before
+// the point.
+void lex_line_from(Syntax syntax, std::string_view line, LexPoint from, long base, unsigned char* colors)
+{
+    lex(syntax, line, from, { colors, base }, { nullptr, 0 });
+}
+
+// Points between tokens about every interval bytes of the line,
+// with the state that lexing can be resumed in at each of them
+std::vector<LexPoint> lex_points(Syntax syntax, std::string_view line, unsigned char state, long interval)
+{
+    std::vector<LexPoint> points;
+    lex(syntax, line, { 0, state }, { nullptr, 0 }, { &points, interval });
+    return points;
+}
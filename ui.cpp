@@ -1,23 +1,90 @@
 #include "med.h"
 
+#include <algorithm>
 #include <ncurses.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
 
 extern void error(std::string_view txt);
-#ifdef MED_UTF8
-extern int utf8_length_bytes(std::string_view str, int index, int chars);
-#endif
+extern int char_width(std::string_view str, long index, long end, int col, int& len);
+extern long advance_cols(std::string_view str, long index, long end, int& col, int max_col);
+extern void lex_line_from(Syntax syntax, std::string_view line, LexPoint from, long base, unsigned char* colors);
 
 extern PromptType show_prompt;
 
-constexpr std::string_view prompt_quit = "Save changes (y/n/q)? ";
+constexpr std::string_view prompt_quit = "Save changes (y/n/a/q)? ";
 constexpr std::string_view prompt_search = "Search: ";
 constexpr std::string_view prompt_goline = "Goto line: ";
 constexpr std::string_view prompt_write = "Write file (y/n)? ";
+constexpr std::string_view prompt_overwrite = "File changed on disk, write anyway (y/n)? ";
+constexpr std::string_view prompt_reload = "Reload file from disk (y/n)? ";
+constexpr std::string_view prompt_reload_changes = "Discard changes and reload file (y/n)? ";
+constexpr std::string_view prompt_recover = "Recover unsaved changes (y/n)? ";
+constexpr std::string_view prompt_replace = "Replace: ";
+constexpr std::string_view prompt_replace_query = "Replace (y/n/!/q)? ";
+constexpr std::string_view prompt_lines = "Lines (sort/uniq/keep/flush): ";
 
 // Buffer
 std::string prompt;
 std::string buf;
 
+// Text being replaced
+std::string replace_from;
+
+// Shown in minibuffer until next key
+std::string message;
+
+// Options of the search prompt, kept between searches
+SearchMode search_mode;
+
+// Repeat count for the next command, -1 if not given
+int repeat_count = -1;
+
+// Keys are being recorded into a macro
+bool macro_recording = false;
+
+// Search matches in the visible part of buffer. They are found
+// again only when the pattern, the view or the content changes.
+struct VisibleMatches
+{
+    const Buffer* buffer = nullptr;
+    unsigned long version = 0;
+    int offset_line = 0;
+    int offset_row = 0;
+    int offset_col = 0;
+    bool wrap = false;
+    int width = 0;
+    int height = 0;
+    std::string pattern;
+    SearchMode mode;
+    std::unique_ptr<Searcher> searcher;
+    std::vector<long> starts;
+};
+
+VisibleMatches visible_matches;
+
+// Counts of the marked region, counted again when it changes
+struct RegionStats
+{
+    const Buffer* buffer = nullptr;
+    unsigned long version = 0;
+    long mark = -1;
+    long point = 0;
+    TextStats stats;
+};
+
+RegionStats region_stats;
+
+// Highlight of each visible byte of the row and of buf
+std::vector<unsigned char> line_colors;
+std::vector<unsigned char> buf_colors;
+
+// Color pairs of highlights follow the pair of statusbar
+constexpr short highlight_pair(Highlight hl)
+{
+    return hl == Highlight::normal ? 0 : 1 + static_cast<short>(hl);
+}
+
 [[nodiscard]] int get_screen_height()
 {
     return LINES;
@@ -28,62 +95,218 @@ std::string buf;
     return COLS;
 }
 
-#ifdef MED_UTF8
-constexpr int char_to_buf(std::string_view str, int index, int end)
-#else
-constexpr int char_to_buf(std::string_view str, int index)
-#endif
+// Pattern to highlight in buffer
+std::string_view match_pattern()
 {
-    char first = str[index++];
-    buf.append(1, first);
-    int len = 1;
+    if (show_prompt == PromptType::search) {
+        return prompt;
+    } else if (show_prompt == PromptType::replace_query) {
+        return replace_from;
+    }
 
-#ifdef MED_UTF8
-    if (first & 0b1000'0000) {
-        if (first & 0b1100'0000 && index < end) {
-            buf.append(1, str[index++]);
-            len++;
-        }
-        if (first & 0b1110'0000 && index < end) {
-            buf.append(1, str[index++]);
-            len++;
-        }
-        if (first & 0b1111'0000 && index < end) {
-            buf.append(1, str[index++]);
-            len++;
+    return {};
+}
+
+// Replacing always matches exact text
+SearchMode match_mode()
+{
+    return show_prompt == PromptType::search ? search_mode : SearchMode {};
+}
+
+// Index a little past the last character of row that fits on screen
+long visible_end(std::string_view content, const ScreenRow& row)
+{
+    int col = row.col;
+    long index = advance_cols(content, row.index, row.end, col, row.first_col + get_screen_width());
+    return std::min(row.end, index + 4);
+}
+
+// Find matches in the visible columns of the visible lines
+void find_visible_matches(const Buffer& buffer)
+{
+    auto& matches = visible_matches;
+    auto pattern = match_pattern();
+    auto mode = match_mode();
+
+    if (matches.buffer == &buffer && matches.version == buffer.get_version() &&
+        matches.offset_line == buffer.get_offset_line() &&
+        matches.offset_row == buffer.get_offset_row() &&
+        matches.offset_col == buffer.get_offset_col() && matches.wrap == buffer.get_wrap() &&
+        matches.width == get_screen_width() && matches.height == get_screen_height() &&
+        matches.pattern == pattern && matches.mode == mode) {
+        return;
+    }
+
+    matches.buffer = &buffer;
+    matches.version = buffer.get_version();
+    matches.offset_line = buffer.get_offset_line();
+    matches.offset_row = buffer.get_offset_row();
+    matches.offset_col = buffer.get_offset_col();
+    matches.wrap = buffer.get_wrap();
+    matches.width = get_screen_width();
+    matches.height = get_screen_height();
+    matches.starts.clear();
+
+    if (matches.pattern != pattern || matches.mode != mode || !matches.searcher) {
+        matches.pattern = pattern;
+        matches.mode = mode;
+        matches.searcher = std::make_unique<Searcher>(pattern, mode);
+    }
+
+    if (pattern.empty()) {
+        return;
+    }
+
+    auto content = buffer.get_content();
+    long len = matches.searcher->length();
+
+    for (const auto& row : buffer.visible_rows()) {
+        // Matches may start before the first visible column
+        long end = visible_end(content, row);
+        long start = std::max(std::max(row.start, row.index - len + 1),
+                              matches.starts.empty() ? 0 : matches.starts.back() + len);
+        auto text = content.substr(0, end);
+
+        for (long pos = matches.searcher->find(text, start); pos >= 0; ) {
+            if (pos + len > end) {
+                break;
+            }
+
+            matches.starts.push_back(pos);
+            pos = matches.searcher->find(text, pos + len);
         }
     }
-#endif
+}
+
+// Mark the search matches within line in line_colors
+void paint_matches(long start, long end)
+{
+    const auto& starts = visible_matches.starts;
+    long len = visible_matches.pattern.size();
 
-    return len;
+    auto it = std::lower_bound(starts.begin(), starts.end(), start - len + 1);
+
+    for (; it != starts.end() && *it < end; it++) {
+        auto from = std::max(*it, start);
+        auto to = std::min(*it + len, end);
+
+        std::fill(line_colors.begin() + (from - start), line_colors.begin() + (to - start),
+                  static_cast<unsigned char>(Highlight::match));
+    }
 }
 
-// Write given line to buf and return the length
-void line_to_buf(const Buffer& buffer, const int line)
+// Write given row to buf
+void line_to_buf(const Buffer& buffer, const ScreenRow& row)
 {
-    int max_chars = get_screen_width();
-    int chars = 0;
+    int first_col = row.first_col;
+    int max_col = first_col + get_screen_width();
 
     buf.clear();
+    buf_colors.clear();
 
     auto content = buffer.get_content();
-    int index = buffer.line_start(line);
-    int end = buffer.line_end(line);
+    long start = row.index;
+    long end = row.end;
 
     // Skip over offset columns
-#ifdef MED_UTF8
-    index += utf8_length_bytes(content, index, buffer.get_offset_col());
-#else
-    index += buffer.get_offset_col();
-#endif
+    long index = row.index;
+    int col = row.col;
 
-    while (chars < max_chars && index < end) {
-#ifdef MED_UTF8
-        index += char_to_buf(content, index, end);
-#else
-        index += char_to_buf(content, index);
-#endif
-        chars++;
+    // Color the visible characters, lexing from the nearest point before them
+    long visible = visible_end(content, row);
+    line_colors.assign(visible - start, 0);
+
+    if (buffer.get_syntax() != Syntax::none) {
+        lex_line_from(buffer.get_syntax(), content.substr(row.start, visible - row.start),
+                      { row.lex_start - row.start, row.state }, start - row.start, line_colors.data());
+    }
+
+    paint_matches(start, visible);
+
+    while (index < end) {
+        int len;
+        int width = char_width(content, index, end, col, len);
+        char c = content[index];
+
+        if (col + width > max_col) {
+            break;
+        }
+
+        if (col < first_col) {
+            // Character is partly scrolled out of view
+            buf.append(col + width - first_col, ' ');
+        } else if (c == '\t') {
+            buf.append(width, ' ');
+        } else if ((c >= 0 && c < 32) || c == 127) {
+            buf.append(1, '^');
+            buf.append(1, c ^ 0b0100'0000);
+        } else {
+            buf.append(content.substr(index, len));
+        }
+
+        buf_colors.resize(buf.size(), index < visible ? line_colors[index - start] : 0);
+
+        col += width;
+        index += len;
+    }
+}
+
+// Print runs of bytes in buf with the same highlight
+void draw_runs()
+{
+    for (std::size_t from = 0; from < buf.size(); ) {
+        auto to = from + 1;
+        while (to < buf.size() && buf_colors[to] == buf_colors[from]) {
+            to++;
+        }
+
+        color_set(highlight_pair(static_cast<Highlight>(buf_colors[from])), 0);
+        addnstr(buf.data() + from, to - from);
+        from = to;
+    }
+}
+
+// Row of hex view: offset, bytes in hex and the same bytes as
+// characters. Changed bytes are highlighted.
+void hex_row_to_buf(const HexView& hex, long row)
+{
+    constexpr char digits[] = "0123456789abcdef";
+
+    long start = row * HexView::row_bytes;
+    int count = static_cast<int>(std::min<long>(HexView::row_bytes, hex.get_size() - start));
+
+    buf.clear();
+    buf_colors.clear();
+
+    for (int shift = (hex.offset_width() - 1) * 4; shift >= 0; shift -= 4) {
+        buf.append(1, digits[(start >> shift) & 0xF]);
+    }
+
+    buf_colors.resize(buf.size(), static_cast<unsigned char>(Highlight::comment));
+
+    std::string text;
+
+    for (int i = 0; i < count; i++) {
+        unsigned char byte = hex.byte_at(start + i);
+        auto color = static_cast<unsigned char>(hex.is_changed(start + i) ? Highlight::error : Highlight::normal);
+
+        buf.append(hex.byte_col(i) - buf.size(), ' ');
+        buf_colors.resize(buf.size(), 0);
+        buf.append(1, digits[byte >> 4]);
+        buf.append(1, digits[byte & 0xF]);
+        buf_colors.resize(buf.size(), color);
+
+        text.append(1, byte >= 32 && byte < 127 ? byte : '.');
+    }
+
+    buf.append(hex.text_col() - buf.size(), ' ');
+    buf.append(text);
+    buf_colors.resize(buf.size(), 0);
+
+    // Cut at screen width, the rows do not scroll sideways
+    if (static_cast<int>(buf.size()) > get_screen_width()) {
+        buf.resize(get_screen_width());
+        buf_colors.resize(get_screen_width());
     }
 }
 
@@ -91,15 +314,65 @@ void Screen::draw_buffer(const Buffer& buffer)
 {
     color_set(0, 0);
 
+    if (buffer.get_hex()) {
+        draw_hex(*buffer.get_hex());
+        return;
+    }
+
+    find_visible_matches(buffer);
+
+    auto rows = buffer.visible_rows();
+
+    for (int row = 0; row < static_cast<int>(rows.size()); row++) {
+        line_to_buf(buffer, rows[row]);
+        move(row, 0);
+        draw_runs();
+    }
+
+    color_set(0, 0);
+}
+
+void Screen::draw_hex(const HexView& hex)
+{
     for (int row = 0; row < (get_screen_height() - 2); row++) {
-        int line = row + buffer.get_offset_line();
-        if (line >= buffer.num_of_lines()) {
+        long index = row + hex.get_offset_row();
+
+        if (index * HexView::row_bytes >= hex.get_size()) {
             break;
         }
 
-        line_to_buf(buffer, line);
-        mvaddnstr(row, 0, buf.data(), buf.size());
+        hex_row_to_buf(hex, index);
+        move(row, 0);
+        draw_runs();
+    }
+
+    color_set(0, 0);
+}
+
+std::string format_stats(const TextStats& stats)
+{
+    return std::to_string(stats.lines) + " lines " + std::to_string(stats.words) + " words " +
+        std::to_string(stats.bytes) + " bytes " + std::to_string(stats.chars) + " chars";
+}
+
+// Size with a unit, at least four digits before switching to the next
+std::string format_bytes(long bytes)
+{
+    constexpr std::string_view units[] = { "", "K", "M", "G" };
+    int unit = 0;
+
+    while (bytes >= 10 * 1024 && unit < 3) {
+        bytes /= 1024;
+        unit++;
     }
+
+    return std::to_string(bytes) + std::string(units[unit]);
+}
+
+std::string format_memory(const MemoryStats& stats)
+{
+    return "text " + format_bytes(stats.text) + " index " + format_bytes(stats.index) +
+        " caches " + format_bytes(stats.caches) + " journal " + format_bytes(stats.journal);
 }
 
 void Screen::draw_statusbar(const Buffer& buffer)
@@ -109,34 +382,133 @@ void Screen::draw_statusbar(const Buffer& buffer)
 
     buf.append(buffer.get_content_changed() ? "  *" : "");
     buf.append(buffer.get_edit_mode() ? "  EDIT  " : "  ");
-    buf.append(std::to_string(buffer.current_line() + 1));
-    buf.append(":");
-    buf.append(std::to_string(buffer.current_virtual_col()));
+    buf.append(buffer.get_read_only() ? "READ ONLY  " : "");
+    buf.append(buffer.get_follow() ? "FOLLOW  " : "");
+    buf.append(buffer.get_wrap() ? "WRAP  " : "");
+    buf.append(buffer.get_load_fd() >= 0 ? "LOADING  " : "");
+
+    if (buffer.save_progress() >= 0) {
+        buf.append("SAVING " + std::to_string(buffer.save_progress()) + "%  ");
+    }
+
+    buf.append(buffer.get_changed_on_disk() ? "CHANGED ON DISK  " : "");
+
+    buf.append(macro_recording ? "RECORDING  " : "");
+    buf.append(buffer.get_mark() >= 0 ? "MARK  " : "");
+
+    if (repeat_count >= 0) {
+        buf.append("REPEAT " + std::to_string(repeat_count) + "  ");
+    }
+
+    if (auto hex = buffer.get_hex()) {
+        buf.append("HEX  " + std::to_string(hex->get_point()) + "/" + std::to_string(hex->get_size()));
+    } else {
+        buf.append(std::to_string(buffer.current_line() + 1));
+        buf.append(":");
+        buf.append(std::to_string(buffer.current_virtual_col()));
+    }
     buf.append("  ");
     buf.append(buffer.get_filename());
 
+    if (show_stats) {
+        buf.append("  frames " + std::to_string(frames) + " skipped " + std::to_string(skipped));
+    }
+
+    if (show_text_stats) {
+        buf.append("  " + format_stats(buffer.get_stats()));
+
+        if (buffer.get_mark() >= 0) {
+            if (region_stats.buffer != &buffer || region_stats.version != buffer.get_version() ||
+                region_stats.mark != buffer.get_mark() || region_stats.point != buffer.get_point()) {
+                region_stats = { &buffer, buffer.get_version(), buffer.get_mark(),
+                                 buffer.get_point(), buffer.region_stats() };
+            }
+
+            buf.append("  region " + format_stats(region_stats.stats));
+        }
+    }
+
+    if (show_memory_stats) {
+        buf.append("  " + format_memory(buffer.memory_usage(true)) + " screen " + format_bytes(memory_usage()));
+    }
+
     // Fill remainder with spaces
     if (static_cast<int>(buf.size()) < get_screen_width()) {
         buf.append(get_screen_width() - buf.size(), ' ');
     }
 
-    mvaddnstr(get_screen_height() - 2, 0, buf.data(), buf.size());
+    mvaddnstr(get_screen_height() - 2, 0, buf.data(), std::min<int>(buf.size(), get_screen_width()));
+}
+
+// Warn before overwriting changes made by others
+std::string_view write_prompt(const Buffer& buffer)
+{
+    return buffer.get_changed_on_disk() ? prompt_overwrite : prompt_write;
+}
+
+std::string_view reload_prompt(const Buffer& buffer)
+{
+    return buffer.get_content_changed() ? prompt_reload_changes : prompt_reload;
+}
+
+// Search prompt tells which options are on
+std::string search_prompt()
+{
+    if (search_mode.ignore_case && search_mode.whole_word) {
+        return "Search (ignore case, whole word): ";
+    } else if (search_mode.ignore_case) {
+        return "Search (ignore case): ";
+    } else if (search_mode.whole_word) {
+        return "Search (whole word): ";
+    }
+
+    return std::string(prompt_search);
+}
+
+std::string replace_with_prompt()
+{
+    return "Replace " + replace_from + " with: ";
 }
 
-void Screen::draw_minibuffer()
+void Screen::draw_minibuffer(const Buffer& buffer)
 {
     color_set(0, 0);
 
     if (show_prompt == PromptType::quit) {
         mvaddnstr(get_screen_height() - 1, 0, prompt_quit.data(), prompt_quit.size());
     } else if (show_prompt == PromptType::search) {
-        mvaddnstr(get_screen_height() - 1, 0, prompt_search.data(), prompt_search.size());
-        mvaddnstr(get_screen_height() - 1, prompt_search.size(), prompt.data(), prompt.size());
+        auto text = search_prompt() + prompt;
+        mvaddnstr(get_screen_height() - 1, 0, text.data(), text.size());
+
+        if (!prompt.empty()) {
+            long count = buffer.match_count();
+            auto text = count < 0 ? std::string("  [counting]") : "  [" + std::to_string(count) + " matches]";
+            addnstr(text.data(), text.size());
+        }
     } else if (show_prompt == PromptType::write) {
-        mvaddnstr(get_screen_height() - 1, 0, prompt_write.data(), prompt_write.size());
+        auto text = write_prompt(buffer);
+        mvaddnstr(get_screen_height() - 1, 0, text.data(), text.size());
+    } else if (show_prompt == PromptType::reload) {
+        auto text = reload_prompt(buffer);
+        mvaddnstr(get_screen_height() - 1, 0, text.data(), text.size());
+    } else if (show_prompt == PromptType::recover) {
+        mvaddnstr(get_screen_height() - 1, 0, prompt_recover.data(), prompt_recover.size());
+    } else if (show_prompt == PromptType::message) {
+        mvaddnstr(get_screen_height() - 1, 0, message.data(), message.size());
+    } else if (show_prompt == PromptType::replace) {
+        mvaddnstr(get_screen_height() - 1, 0, prompt_replace.data(), prompt_replace.size());
+        mvaddnstr(get_screen_height() - 1, prompt_replace.size(), prompt.data(), prompt.size());
+    } else if (show_prompt == PromptType::replace_with) {
+        auto text = replace_with_prompt() + prompt;
+        mvaddnstr(get_screen_height() - 1, 0, text.data(), text.size());
+    } else if (show_prompt == PromptType::replace_query) {
+        mvaddnstr(get_screen_height() - 1, 0, prompt_replace_query.data(), prompt_replace_query.size());
     } else if (show_prompt == PromptType::goline) {
         mvaddnstr(get_screen_height() - 1, 0, prompt_goline.data(), prompt_goline.size());
         mvaddnstr(get_screen_height() - 1, prompt_goline.size(), prompt.data(), prompt.size());
+    } else if (show_prompt == PromptType::lines) {
+        mvaddnstr(get_screen_height() - 1, 0, prompt_lines.data(), prompt_lines.size());
+        mvaddnstr(get_screen_height() - 1, prompt_lines.size(), prompt.data(), prompt.size());
     }
 }
 
@@ -147,7 +519,34 @@ void Screen::draw_cursor(const Buffer& buffer)
     } else if (show_prompt == PromptType::goline) {
         move(get_screen_height() - 1, prompt_goline.size() + prompt.size());
     } else if (show_prompt == PromptType::write) {
-        move(get_screen_height() - 1, prompt_write.size());
+        move(get_screen_height() - 1, write_prompt(buffer).size());
+    } else if (show_prompt == PromptType::reload) {
+        move(get_screen_height() - 1, reload_prompt(buffer).size());
+    } else if (show_prompt == PromptType::recover) {
+        move(get_screen_height() - 1, prompt_recover.size());
+    } else if (show_prompt == PromptType::replace) {
+        move(get_screen_height() - 1, prompt_replace.size() + prompt.size());
+    } else if (show_prompt == PromptType::replace_with) {
+        move(get_screen_height() - 1, replace_with_prompt().size() + prompt.size());
+    } else if (show_prompt == PromptType::lines) {
+        move(get_screen_height() - 1, prompt_lines.size() + prompt.size());
+    } else if (auto hex = buffer.get_hex()) {
+        long point = hex->get_point();
+        move(point / HexView::row_bytes - hex->get_offset_row(),
+             hex->byte_col(point % HexView::row_bytes) + (hex->get_low_nibble() ? 1 : 0));
+    } else if (buffer.get_wrap()) {
+        // Last row of the line that starts at or before point
+        auto rows = buffer.visible_rows();
+        int line = buffer.current_line();
+        int row = 0;
+
+        for (int i = 0; i < static_cast<int>(rows.size()); i++) {
+            if (rows[i].line == line && rows[i].index <= buffer.get_point()) {
+                row = i;
+            }
+        }
+
+        move(row, buffer.current_virtual_col() - (rows.empty() ? 0 : rows[row].col));
     } else {
         move(buffer.current_line() - buffer.get_offset_line(),
              buffer.current_virtual_col() - buffer.get_offset_col());
@@ -165,19 +564,58 @@ void Screen::draw(Buffer& buffer)
 
     buffer.set_screen_size(get_screen_width(), get_screen_height());
 
+    // Count matches while searching, a new pattern cancels the old count
+    buffer.count_matches(show_prompt == PromptType::search ? prompt : "", search_mode);
+
     draw_buffer(buffer);
     draw_statusbar(buffer);
-    draw_minibuffer();
+    draw_minibuffer(buffer);
     draw_cursor(buffer);
 
     refresh();
+    frames++;
 }
 
 void Screen::size_changed()
 {
+    // Window size changes are handled by the event loop
+    // instead of ncurses so get the new size here
+    winsize size;
+
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && is_term_resized(size.ws_row, size.ws_col)) {
+        resizeterm(size.ws_row, size.ws_col);
+    }
+
     redraw_screen = true;
 }
 
+void Screen::frame_skipped()
+{
+    skipped++;
+}
+
+void Screen::toggle_stats()
+{
+    show_stats = !show_stats;
+}
+
+void Screen::toggle_text_stats()
+{
+    show_text_stats = !show_text_stats;
+}
+
+void Screen::toggle_memory_stats()
+{
+    show_memory_stats = !show_memory_stats;
+}
+
+// Staging buffers for drawing, they grow to the longest line drawn
+long Screen::memory_usage() const
+{
+    return buf.capacity() + prompt.capacity() + line_colors.capacity() + buf_colors.capacity() +
+        visible_matches.starts.capacity() * sizeof(long);
+}
+
 // Constructor
 Screen::Screen()
 {
@@ -195,19 +633,41 @@ Screen::Screen()
     noecho();
     intrflush(stdscr, false);
     keypad(stdscr, true);
+    nodelay(stdscr, true);
+    set_escdelay(escape_timeout);
 
-    // Use 4 spaces for tabs
-    set_tabsize(4);
+    // Tabs are expanded when drawing but set the size anyway
+    set_tabsize(tab_size);
 
     // Enable color
     start_color();
     use_default_colors();
     assume_default_colors(-1, -1);
     init_pair(1, COLOR_BLACK, COLOR_WHITE);
+
+    // Syntax highlighting
+    init_pair(highlight_pair(Highlight::comment), COLOR_CYAN, -1);
+    init_pair(highlight_pair(Highlight::string), COLOR_GREEN, -1);
+    init_pair(highlight_pair(Highlight::keyword), COLOR_YELLOW, -1);
+    init_pair(highlight_pair(Highlight::number), COLOR_MAGENTA, -1);
+    init_pair(highlight_pair(Highlight::preprocessor), COLOR_BLUE, -1);
+    init_pair(highlight_pair(Highlight::error), COLOR_RED, -1);
+    init_pair(highlight_pair(Highlight::warning), COLOR_YELLOW, -1);
+    init_pair(highlight_pair(Highlight::info), COLOR_GREEN, -1);
+    init_pair(highlight_pair(Highlight::date), COLOR_CYAN, -1);
+    init_pair(highlight_pair(Highlight::match), COLOR_BLACK, COLOR_YELLOW);
 }
 
 // Destructor
 Screen::~Screen()
+{
+    if (!isendwin()) {
+        endwin();
+    }
+}
+
+// Give the terminal back before the editor exits
+void Screen::close()
 {
     endwin();
 }
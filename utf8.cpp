@@ -1,30 +1,32 @@
 #include "med.h"
 
+#include <array>
+#include <cwchar>
+#include <cwctype>
+
 // Length of one UTF-8 character in bytes
-constexpr int utf8_char_length(std::string_view str, int index, int end)
+constexpr int utf8_char_length(std::string_view str, long index, long end)
 {
-    char first = str[index++];
+    char first = str[index];
     int len = 1;
 
-    if (first & 0b1100'0000 && index < end) {
-        index++;
-        len++;
-
-        if (first & 0b1110'0000 && index < end) {
-            index++;
-            len++;
+    // The high bits of the first byte tell the length of the sequence
+    if ((first & 0b1110'0000) == 0b1100'0000) {
+        len = 2;
+    } else if ((first & 0b1111'0000) == 0b1110'0000) {
+        len = 3;
+    } else if ((first & 0b1111'1000) == 0b1111'0000) {
+        len = 4;
+    }
 
-            if (first & 0b1111'0000 && index < end) {
-                index++;
-                len++;
-            }
-        }
+    if (index + len > end) {
+        len = end - index;
     }
 
     return len;
 }
 
-constexpr int utf8_char_length_reverse(std::string_view str, int index, int end)
+constexpr int utf8_char_length_reverse(std::string_view str, long index, long end)
 {
     char c = str[index--];
     int len = 1;
@@ -39,7 +41,7 @@ constexpr int utf8_char_length_reverse(std::string_view str, int index, int end)
 }
 
 // Number of UTF-8 characters in string
-int utf8_length_chars(std::string_view str, int index, int end)
+int utf8_length_chars(std::string_view str, long index, long end)
 {
     int len = 0;
 
@@ -52,9 +54,9 @@ int utf8_length_chars(std::string_view str, int index, int end)
 }
 
 // Number of bytes in x UTF-8 characters
-int utf8_length_bytes(std::string_view str, int index, int chars)
+int utf8_length_bytes(std::string_view str, long index, int chars)
 {
-    int end = static_cast<int>(str.length());
+    long end = static_cast<long>(str.length());
     int result = 0;
     int c = 0;
 
@@ -69,12 +71,12 @@ int utf8_length_bytes(std::string_view str, int index, int chars)
 }
 
 // Number of bytes in x previous UTF-8 characters
-int utf8_length_bytes_reverse(std::string_view str, int index, int chars)
+int utf8_length_bytes_reverse(std::string_view str, long index, int chars)
 {
     int result = 0;
     int c = 0;
 
-    while (index > 0 && c < chars) {
+    while (index >= 0 && c < chars) {
         int len = utf8_char_length_reverse(str, index, 0);
         index -= len;
         result += len;
@@ -83,3 +85,72 @@ int utf8_length_bytes_reverse(std::string_view str, int index, int chars)
 
     return result;
 }
+
+// Decode the UTF-8 character of given length at index
+constexpr char32_t utf8_decode(std::string_view str, long index, int len)
+{
+    auto byte = [&](int i) {
+        return static_cast<char32_t>(static_cast<unsigned char>(str[index + i]));
+    };
+
+    if (len == 2) {
+        return ((byte(0) & 0b0001'1111) << 6) | (byte(1) & 0b0011'1111);
+    } else if (len == 3) {
+        return ((byte(0) & 0b0000'1111) << 12) | ((byte(1) & 0b0011'1111) << 6) |
+            (byte(2) & 0b0011'1111);
+    } else if (len == 4) {
+        return ((byte(0) & 0b0000'0111) << 18) | ((byte(1) & 0b0011'1111) << 12) |
+            ((byte(2) & 0b0011'1111) << 6) | (byte(3) & 0b0011'1111);
+    }
+
+    return byte(0);
+}
+
+// Display width of a code point in the Basic Multilingual Plane.
+// Widths are packed two bits per code point into a 16 KiB table
+// which is filled from wcwidth() on first use, so they agree with
+// what ncurses draws on the screen.
+int bmp_width(char32_t code)
+{
+    static const auto table = [] {
+        std::array<unsigned char, 0x10000 / 4> widths {};
+
+        for (int c = 0; c < 0x10000; c++) {
+            int width = wcwidth(c);
+
+            // Unprintable characters take one column
+            if (width < 0 || width > 2) {
+                width = 1;
+            }
+
+            widths[c / 4] |= width << ((c % 4) * 2);
+        }
+
+        return widths;
+    }();
+
+    return (table[code / 4] >> ((code % 4) * 2)) & 0b11;
+}
+
+// Display width of the UTF-8 character at index,
+// its length in bytes is stored in len
+int utf8_char_width(std::string_view str, long index, long end, int& len)
+{
+    len = utf8_char_length(str, index, end);
+    char32_t code = utf8_decode(str, index, len);
+
+    if (code < 0x10000) {
+        return bmp_width(code);
+    }
+
+    int width = wcwidth(code);
+    return width < 0 ? 1 : width;
+}
+
+// Is the UTF-8 character at index a letter or digit,
+// its length in bytes is stored in len
+bool utf8_char_is_word(std::string_view str, long index, long end, int& len)
+{
+    len = utf8_char_length(str, index, end);
+    return iswalnum(utf8_decode(str, index, len));
+}
@@ -0,0 +1,668 @@
+#include "med.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+
+extern void error(std::string_view txt);
+extern bool map_file(const std::string& filename, const char*& data, long& size);
+extern void unmap_file(const char* data, long size);
+extern int char_width(std::string_view str, long index, long end, int col, int& len);
+extern long advance_cols(std::string_view str, long index, long end, int& col, int max_col);
+extern long find_word_end(std::string_view str, long index);
+extern long find_word_start(std::string_view str, long index);
+extern long count_word_starts(std::string_view str, long from, long to);
+extern long count_chars(std::string_view str, long from, long to);
+extern std::vector<LexPoint> lex_points(Syntax syntax, std::string_view line, unsigned char state, long interval);
+
+#ifdef MED_UTF8
+extern int utf8_length_bytes(std::string_view str, long index, int chars);
+extern int utf8_length_bytes_reverse(std::string_view str, long index, int chars);
+#endif
+
+// Start of every this many lines is kept as a checkpoint
+constexpr long checkpoint_lines = 1024;
+
+// Line of a new point is found by counting lines from the old
+// point if it is closer than this, otherwise from a checkpoint
+constexpr long near_distance = 1024 * 1024;
+
+// Lines longer than this get checkpoints every this many bytes
+constexpr long long_line_size = 4096;
+
+// Number of long lines that are remembered
+constexpr std::size_t max_long_lines = 64;
+
+TextView::TextView(const std::string& filename, Syntax syntax_type)
+{
+    syntax = syntax_type;
+
+    if (!map_file(filename, data, size)) {
+        error("Unable to read file");
+    }
+
+    checkpoints.push_back(0);
+}
+
+TextView::~TextView()
+{
+    unmap_file(data, size);
+}
+
+// Map the file again after it changed on disk. Lines that were
+// scanned stay valid if the file only grew at the end. Returns
+// false if the file could not be mapped, then the view is empty
+// until it can be.
+bool TextView::remap(const std::string& filename, bool appended)
+{
+    unmap_file(data, size);
+    bool ok = map_file(filename, data, size);
+
+    // Other files are shown again from the start
+    if (!appended || !ok) {
+        checkpoints.assign(1, 0);
+        scanned = 0;
+        scanned_line = 0;
+        top = 0;
+        top_line = 0;
+    }
+
+    // Last line may have grown
+    long_lines.clear();
+
+    counted = false;
+    previous_point = std::min(previous_point, size);
+
+    point = std::min(point, size);
+    point_line = line_number(point);
+    reconcile_by_scrolling();
+    return ok;
+}
+
+// Scan lines until index and line are reached or the file ends
+void TextView::scan_until(long index, long line) const
+{
+    while (scanned < index || scanned_line < line) {
+        auto found = static_cast<const char*>(memchr(data + scanned, '\n', size - scanned));
+
+        if (!found) {
+            break;
+        }
+
+        scanned = found - data + 1;
+        scanned_line++;
+
+        if (scanned_line % checkpoint_lines == 0) {
+            checkpoints.push_back(scanned);
+        }
+    }
+}
+
+// Number of line breaks between from and to
+long TextView::count_lines(long from, long to) const
+{
+    long count = 0;
+
+    while (from < to) {
+        auto found = static_cast<const char*>(memchr(data + from, '\n', to - from));
+
+        if (!found) {
+            break;
+        }
+
+        from = found - data + 1;
+        count++;
+    }
+
+    return count;
+}
+
+// Line that contains index, counted from the checkpoint before it
+long TextView::line_number(long index) const
+{
+    scan_until(index, 0);
+
+    auto it = std::upper_bound(checkpoints.begin(), checkpoints.end(), index) - 1;
+    long chunk = it - checkpoints.begin();
+
+    return chunk * checkpoint_lines + count_lines(*it, index);
+}
+
+// Long line that contains index, or null if it is not known
+const TextView::LongLine* TextView::find_long_line(long index) const
+{
+    for (const auto& line : long_lines) {
+        if (line.start <= index && index <= line.end) {
+            return &line;
+        }
+    }
+
+    return nullptr;
+}
+
+// Remember a long line that was scanned, the oldest is forgotten
+void TextView::add_long_line(long start, long end) const
+{
+    if (long_lines.size() >= max_long_lines) {
+        long_lines.erase(long_lines.begin());
+    }
+
+    auto& line = long_lines.emplace_back(LongLine { start, end, {}, {} });
+    long index = start;
+    int col = 0;
+
+    line.chunks.push_back({ index, col });
+
+    while (index < end) {
+        index = advance_cols(get_text(), index, std::min(index + long_line_size, end), col, INT_MAX);
+        line.chunks.push_back({ index, col });
+    }
+
+    if (syntax != Syntax::none) {
+        line.lex_points = lex_points(syntax, get_text().substr(start, end - start), 0, long_line_size);
+    }
+}
+
+// Start of the line that contains index
+long TextView::line_begin(long index) const
+{
+    if (index <= 0) {
+        return 0;
+    }
+
+    if (auto line = find_long_line(index)) {
+        return line->start;
+    }
+
+    auto found = static_cast<const char*>(memrchr(data, '\n', index));
+    long start = found ? found - data + 1 : 0;
+
+    if (index - start >= long_line_size) {
+        auto end = static_cast<const char*>(memchr(data + index, '\n', size - index));
+        add_long_line(start, end ? end - data : size);
+    }
+
+    return start;
+}
+
+// End of the line that contains index
+long TextView::line_finish(long index) const
+{
+    if (auto line = find_long_line(index)) {
+        return line->end;
+    }
+
+    auto found = static_cast<const char*>(memchr(data + index, '\n', size - index));
+    long end = found ? found - data : size;
+
+    if (end - index >= long_line_size) {
+        auto start = index > 0 ? static_cast<const char*>(memrchr(data, '\n', index)) : nullptr;
+        add_long_line(start ? start - data + 1 : 0, end);
+    }
+
+    return end;
+}
+
+// Start of the line count lines after the line that starts at
+// start, or of the last line. Lines moved are stored in moved.
+long TextView::lines_forward(long start, long count, long& moved) const
+{
+    moved = 0;
+
+    while (moved < count) {
+        long end = line_finish(start);
+
+        if (end == size) {
+            break;
+        }
+
+        start = end + 1;
+        moved++;
+    }
+
+    return start;
+}
+
+long TextView::lines_backward(long start, long count, long& moved) const
+{
+    moved = 0;
+
+    while (moved < count && start > 0) {
+        start = line_begin(start - 1);
+        moved++;
+    }
+
+    return start;
+}
+
+// Virtual column of index on its line, counted
+// from the last chunk before it on long lines
+int TextView::col_of(long index) const
+{
+    long start = line_begin(index);
+    int col = 0;
+
+    if (auto line = find_long_line(index)) {
+        auto chunk = std::upper_bound(line->chunks.begin(), line->chunks.end(), index,
+            [](long i, const LongLine::Chunk& ch) { return i < ch.index; }) - 1;
+
+        start = chunk->index;
+        col = chunk->col;
+    }
+
+    advance_cols(get_text(), start, index, col, INT_MAX);
+    return col;
+}
+
+// Index of the character that covers col on the line at start
+long TextView::col_index(long start, int col) const
+{
+    long end = line_finish(start);
+    int current = 0;
+
+    if (auto line = find_long_line(start); line && col > 0) {
+        auto chunk = std::upper_bound(line->chunks.begin(), line->chunks.end(), col,
+            [](int c, const LongLine::Chunk& ch) { return c < ch.col; }) - 1;
+
+        start = chunk->index;
+        current = chunk->col;
+    }
+
+    return advance_cols(get_text(), start, end, current, col);
+}
+
+// Setters
+
+void TextView::set_point(long value, bool set_goal)
+{
+    value = std::clamp(value, 0L, size);
+
+    if (std::abs(value - point) < near_distance) {
+        point_line += value > point ? count_lines(point, value) : -count_lines(value, point);
+    } else {
+        point_line = line_number(value);
+    }
+
+    point = value;
+    reconcile_by_scrolling();
+
+    if (set_goal) {
+        goal_col = col_of(point);
+    }
+}
+
+// Move point to the goal column of the line at start
+void TextView::set_line(long start, long line, bool reconcile)
+{
+    point = col_index(start, goal_col);
+    point_line = line;
+
+    if (reconcile) {
+        reconcile_by_scrolling();
+    }
+}
+
+void TextView::scroll_lines(long delta)
+{
+    long moved;
+
+    if (delta > 0) {
+        top = lines_forward(top, delta, moved);
+        top_line += moved;
+    } else {
+        top = lines_backward(top, -delta, moved);
+        top_line -= moved;
+    }
+
+    reconcile_by_moving_point();
+}
+
+// Reconciliation works like in the buffer, but lines are
+// found by scanning from the top line or from point
+
+void TextView::reconcile_by_moving_point()
+{
+    if (point_line < top_line) {
+        set_line(top, top_line, false);
+    } else if (point_line > top_line + rows - 1) {
+        long moved;
+        long start = lines_forward(top, rows - 1, moved);
+        set_line(start, top_line + moved, false);
+    }
+
+    long start = line_begin(point);
+    int col = col_of(point);
+
+    if (col < offset_col) {
+        long index = col_index(start, offset_col);
+
+        // Skip the character if it is partly scrolled out of view
+        if (index < line_finish(start) && col_of(index) < offset_col) {
+            int len;
+            char_width(get_text(), index, line_finish(start), 0, len);
+            index += len;
+        }
+
+        point = index;
+        goal_col = col_of(point);
+    } else if (col > offset_col + width - 1) {
+        point = col_index(start, offset_col + width - 1);
+        goal_col = col_of(point);
+    }
+}
+
+void TextView::reconcile_by_scrolling()
+{
+    if (point_line < top_line) {
+        top = line_begin(point);
+        top_line = point_line;
+    } else if (point_line > top_line + rows - 1) {
+        long moved;
+        top = lines_backward(line_begin(point), rows - 1, moved);
+        top_line = point_line - moved;
+    }
+
+    int col = col_of(point);
+
+    // Last column of a wide character or tab must be visible too
+    int last_col = col;
+    long end = line_finish(point);
+
+    if (point < end) {
+        int len;
+        last_col += char_width(get_text(), point, end, col, len) - 1;
+    }
+
+    if (col < offset_col) {
+        offset_col = col;
+    } else if (last_col > offset_col + width - 1) {
+        offset_col = last_col - width + 1;
+    }
+}
+
+// Getters
+
+std::string_view TextView::get_text() const
+{
+    return { data, static_cast<std::size_t>(size) };
+}
+
+long TextView::get_point() const
+{
+    return point;
+}
+
+long TextView::current_line() const
+{
+    return point_line;
+}
+
+int TextView::current_col() const
+{
+    return col_of(point);
+}
+
+long TextView::get_top_line() const
+{
+    return top_line;
+}
+
+int TextView::get_offset_col() const
+{
+    return offset_col;
+}
+
+// Only the lines on the screen are looked at
+std::vector<ScreenRow> TextView::visible_rows() const
+{
+    std::vector<ScreenRow> result;
+    long start = top;
+
+    for (long line = top_line; static_cast<int>(result.size()) < rows; line++) {
+        long end = line_finish(start);
+        long index = col_index(start, offset_col);
+
+        // Lexers start each line in the normal state, which
+        // is right for logs that are the usual files to view
+        ScreenRow row = { static_cast<int>(line), start, end, index, col_of(index), offset_col, start, 0 };
+
+        if (auto long_line = find_long_line(start)) {
+            auto point = std::upper_bound(long_line->lex_points.begin(), long_line->lex_points.end(), index - start,
+                [](long offset, const LexPoint& p) { return offset < p.offset; });
+
+            if (point != long_line->lex_points.begin()) {
+                point--;
+                row.lex_start = start + point->offset;
+                row.state = point->state;
+            }
+        }
+
+        result.push_back(row);
+
+        if (end == size) {
+            break;
+        }
+
+        start = end + 1;
+    }
+
+    return result;
+}
+
+// Counting reads the whole file once
+TextStats TextView::get_stats() const
+{
+    if (!counted) {
+        stats = { line_number(size) + 1, count_word_starts(get_text(), 0, size),
+                  size, count_chars(get_text(), 0, size) };
+        counted = true;
+    }
+
+    return stats;
+}
+
+// The text is mapped, only the checkpoints of lines are allocated
+long TextView::cache_bytes() const
+{
+    long bytes = checkpoints.capacity() * sizeof(long);
+
+    for (const auto& line : long_lines) {
+        bytes += line.chunks.capacity() * sizeof(LongLine::Chunk) + line.lex_points.capacity() * sizeof(LexPoint);
+    }
+
+    return bytes;
+}
+
+void TextView::set_screen_size(int screen_width, int screen_height)
+{
+    if (width != screen_width || rows != screen_height - 2) {
+        width = std::max(1, screen_width);
+        rows = std::max(1, screen_height - 2);
+        reconcile_by_scrolling();
+    }
+}
+
+// Movement
+
+void TextView::begin_of_buffer()
+{
+    set_point(0, true);
+}
+
+// Lines of the whole file are scanned to find the last line
+void TextView::end_of_buffer()
+{
+    set_point(size, true);
+}
+
+void TextView::forward_character(int count)
+{
+#ifdef MED_UTF8
+    set_point(point + utf8_length_bytes(get_text(), point, count), true);
+#else
+    set_point(point + count, true);
+#endif
+}
+
+void TextView::backward_character(int count)
+{
+#ifdef MED_UTF8
+    set_point(point - utf8_length_bytes_reverse(get_text(), point - 1, count), true);
+#else
+    set_point(point - count, true);
+#endif
+}
+
+void TextView::forward_word(int count)
+{
+    long index = point;
+
+    for (int i = 0; i < count && index >= 0; i++) {
+        index = find_word_end(get_text(), index);
+    }
+
+    set_point(index >= 0 ? index : size, true);
+}
+
+void TextView::backward_word(int count)
+{
+    long index = point;
+
+    for (int i = 0; i < count && index >= 0; i++) {
+        index = find_word_start(get_text(), index - 1);
+    }
+
+    set_point(index >= 0 ? index : 0, true);
+}
+
+void TextView::begin_of_line()
+{
+    set_point(line_begin(point), true);
+}
+
+void TextView::end_of_line()
+{
+    set_point(line_finish(point), true);
+}
+
+void TextView::back_to_indentation()
+{
+    long i = line_begin(point);
+    long end = line_finish(i);
+
+    while (i < end && (data[i] == ' ' || data[i] == '\t')) {
+        i++;
+    }
+
+    set_point(i, true);
+}
+
+void TextView::forward_line(int count)
+{
+    long moved;
+    long start = lines_forward(line_begin(point), count, moved);
+
+    if (moved) {
+        set_line(start, point_line + moved, true);
+    }
+}
+
+void TextView::backward_line(int count)
+{
+    long moved;
+    long start = lines_backward(line_begin(point), count, moved);
+
+    if (moved) {
+        set_line(start, point_line - moved, true);
+    }
+}
+
+// Lines are found from the checkpoint before line
+void TextView::goto_line(long line)
+{
+    line = std::max(line, 0L);
+    scan_until(0, line);
+
+    long chunk = std::min(line / checkpoint_lines, static_cast<long>(checkpoints.size()) - 1);
+    long moved;
+    long start = lines_forward(checkpoints[chunk], line - chunk * checkpoint_lines, moved);
+
+    set_line(start, chunk * checkpoint_lines + moved, true);
+    scroll_current_line_middle();
+}
+
+void TextView::store_point_location()
+{
+    previous_point = point;
+}
+
+void TextView::restore_point_location()
+{
+    set_point(previous_point, true);
+}
+
+// Scrolling
+
+void TextView::scroll_left(int count)
+{
+    offset_col = std::max(0, offset_col - count);
+    reconcile_by_moving_point();
+}
+
+void TextView::scroll_right(int count)
+{
+    int max = col_of(line_finish(point)) - 2;
+    offset_col = std::max(0, std::min(offset_col + count, max));
+    reconcile_by_moving_point();
+}
+
+void TextView::scroll_current_line_middle()
+{
+    long moved;
+    top = lines_backward(line_begin(point), rows / 2, moved);
+    top_line = point_line - moved;
+}
+
+void TextView::scroll_page_up(int count)
+{
+    scroll_lines(-static_cast<long>(rows - 1) * count);
+}
+
+void TextView::scroll_page_down(int count)
+{
+    scroll_lines(static_cast<long>(rows - 1) * count);
+}
+
+// Searching
+
+bool TextView::search_forward(std::string_view txt, SearchMode mode)
+{
+    if (point == size) {
+        return false;
+    }
+
+    long pos = Searcher(txt, mode).find(get_text(), point + 1);
+
+    if (pos < 0) {
+        return false;
+    }
+
+    set_point(pos, true);
+    return true;
+}
+
+bool TextView::search_backward(std::string_view txt, SearchMode mode)
+{
+    if (point == 0) {
+        return false;
+    }
+
+    long pos = Searcher(txt, mode).find_last(get_text(), point - 1);
+
+    if (pos < 0) {
+        return false;
+    }
+
+    set_point(pos, true);
+    return true;
+}
@@ -0,0 +1,103 @@
+#include "med.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+extern void error(std::string_view txt);
+
+// Events that tell the contents of a file may have changed.
+// Creation and moves are included to notice rotated files.
+constexpr uint32_t watch_events = IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE |
+    IN_MOVED_TO | IN_DELETE | IN_ATTRIB;
+
+// Directory of file as a string that inotify accepts
+std::string watch_dir(const std::string& filename)
+{
+    auto dir = std::filesystem::path(filename).parent_path();
+    return dir.empty() ? "." : dir.string();
+}
+
+Watcher::Watcher()
+{
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    if (fd < 0) {
+        error("Unable to init inotify");
+    }
+}
+
+Watcher::~Watcher()
+{
+    close(fd);
+}
+
+int Watcher::get_fd() const
+{
+    return fd;
+}
+
+// Watch the directory of file instead of the file itself. That way
+// we get events for a new file that replaces the original one.
+void Watcher::add(const std::string& filename)
+{
+    auto dir = watch_dir(filename);
+
+    for (const auto& watch : dirs) {
+        if (watch.second == dir) {
+            return;
+        }
+    }
+
+    int wd = inotify_add_watch(fd, dir.c_str(), watch_events);
+
+    // Files in unreadable directories just are not watched
+    if (wd >= 0) {
+        dirs[wd] = dir;
+    }
+}
+
+// Read all pending events and return the files that changed.
+// Each file is returned once no matter how many events it got.
+std::vector<std::string> Watcher::read_changes()
+{
+    std::vector<std::string> changed;
+
+    // Buffer must be aligned for inotify_event
+    alignas(inotify_event) char events[16 * 1024];
+
+    while (true) {
+        auto len = read(fd, events, sizeof(events));
+
+        if (len <= 0) {
+            break;
+        }
+
+        for (char* p = events; p < events + len; ) {
+            auto event = reinterpret_cast<inotify_event*>(p);
+            p += sizeof(inotify_event) + event->len;
+
+            auto dir = dirs.find(event->wd);
+
+            if (dir == dirs.end() || event->len == 0) {
+                continue;
+            }
+
+            auto path = (std::filesystem::path(dir->second) / event->name).string();
+
+            if (std::find(changed.begin(), changed.end(), path) == changed.end()) {
+                changed.push_back(path);
+            }
+        }
+    }
+
+    return changed;
+}
+
+// Is path the same file as filename that was given to add()
+bool Watcher::matches(const std::string& path, const std::string& filename)
+{
+    auto name = std::filesystem::path(filename).filename();
+    return std::filesystem::path(path) == std::filesystem::path(watch_dir(filename)) / name;
+}
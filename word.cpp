@@ -0,0 +1,291 @@
+#include "med.h"
+
+#include <array>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef MED_UTF8
+extern bool utf8_char_is_word(std::string_view str, long index, long end, int& len);
+#endif
+
+// Classes of bytes for finding word boundaries
+enum : unsigned char { class_separator, class_word, class_multibyte };
+
+constexpr std::array<unsigned char, 256> make_word_classes()
+{
+    std::array<unsigned char, 256> classes {};
+
+    for (int c = 0; c < 256; c++) {
+        if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) {
+            classes[c] = class_word;
+        } else if (c >= 128) {
+#ifdef MED_UTF8
+            // Must decode the character to know
+            classes[c] = class_multibyte;
+#else
+            classes[c] = class_separator;
+#endif
+        }
+    }
+
+    return classes;
+}
+
+constexpr auto word_classes = make_word_classes();
+
+// Is the character at index part of a word, its length is stored in len
+bool is_word_char(std::string_view str, long index, long end, int& len)
+{
+    auto cls = word_classes[static_cast<unsigned char>(str[index])];
+    len = 1;
+
+#ifdef MED_UTF8
+    if (cls == class_multibyte) {
+        return utf8_char_is_word(str, index, end, len);
+    }
+#else
+    (void) end;
+#endif
+
+    return cls == class_word;
+}
+
+// Start index of the character that contains index
+long char_start(std::string_view str, long index)
+{
+#ifdef MED_UTF8
+    long limit = index - 3;
+
+    while (index > 0 && index > limit && (str[index] & 0b1100'0000) == 0b1000'0000) {
+        index--;
+    }
+#else
+    (void) str;
+#endif
+
+    return index;
+}
+
+#ifdef __SSE2__
+// Classify 16 bytes at once. Returns a bit mask of the bytes
+// that are ASCII letters or digits and stores a bit mask of the
+// bytes that are not ASCII in high.
+unsigned int word_mask16(const char* p, unsigned int& high)
+{
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+
+    // Bytes above 127 are negative so they fail all range checks
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                                  _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+    __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                                  _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+
+    high = _mm_movemask_epi8(v);
+    return _mm_movemask_epi8(_mm_or_si128(digit, alpha));
+}
+#endif
+
+// Find the first end of a word at or after index: a word character
+// followed by a non-word character. Returns the index after the word
+// or -1 if the word continues to the end of the string.
+long find_word_end(std::string_view str, long index)
+{
+    long end = static_cast<long>(str.length());
+    bool in_word = false;
+
+    while (index < end) {
+#ifdef __SSE2__
+        if (index + 16 <= end) {
+            unsigned int high;
+            unsigned int word = word_mask16(str.data() + index, high);
+            int ascii = 16;
+
+#ifdef MED_UTF8
+            // Only the bytes before the first multibyte character
+            // can be classified without decoding
+            if (high) {
+                ascii = __builtin_ctz(high);
+                word &= (1u << ascii) - 1;
+            }
+#else
+            (void) high;
+#endif
+
+            // Bits where a word character is followed by a separator
+            unsigned int ends = ~word & ((word << 1) | (in_word ? 1 : 0)) & ((1u << ascii) - 1);
+
+            if (ends) {
+                return index + __builtin_ctz(ends);
+            }
+
+            if (ascii > 0) {
+                in_word = word & (1u << (ascii - 1));
+                index += ascii;
+                continue;
+            }
+        }
+#endif
+
+        int len;
+        bool is_word = is_word_char(str, index, end, len);
+
+        if (in_word && !is_word) {
+            return index;
+        }
+
+        in_word = is_word;
+        index += len;
+    }
+
+    return -1;
+}
+
+// Find the first start of a word at or before index: a word character
+// preceded by a non-word character. Returns the index of the word or
+// -1 if the word continues to the start of the string.
+long find_word_start(std::string_view str, long index)
+{
+    long end = static_cast<long>(str.length());
+
+    if (index < 0 || index >= end) {
+        return -1;
+    }
+
+    long current = char_start(str, index);
+    int len;
+    bool current_word = is_word_char(str, current, end, len);
+
+    while (current > 0) {
+#ifdef __SSE2__
+        if (current >= 16) {
+            unsigned int high;
+            unsigned int word = word_mask16(str.data() + current - 16, high);
+
+#ifdef MED_UTF8
+            bool ascii = !high;
+#else
+            bool ascii = true;
+#endif
+
+            if (ascii) {
+                // Word starts at current if the byte before is a separator
+                if (current_word && !(word & (1u << 15))) {
+                    return current;
+                }
+
+                // Bits where a word character follows a separator,
+                // the first byte of the block is checked next round
+                unsigned int starts = word & ~(word << 1) & 0xFFFE;
+
+                if (starts) {
+                    return current - 16 + (31 - __builtin_clz(starts));
+                }
+
+                current_word = word & 1;
+                current -= 16;
+                continue;
+            }
+        }
+#endif
+
+        long previous = char_start(str, current - 1);
+        bool previous_word = is_word_char(str, previous, end, len);
+
+        if (current_word && !previous_word) {
+            return current;
+        }
+
+        current = previous;
+        current_word = previous_word;
+    }
+
+    return -1;
+}
+
+// Words are counted by bytes so that counts can be updated by
+// looking only at the bytes around an edit. Each byte of a
+// multibyte character is a word byte if the character is a
+// letter or digit, the same as for word motion.
+bool is_word_byte(std::string_view str, long index)
+{
+    auto cls = word_classes[static_cast<unsigned char>(str[index])];
+
+#ifdef MED_UTF8
+    if (cls == class_multibyte) {
+        long start = char_start(str, index);
+        int len;
+        bool word = utf8_char_is_word(str, start, str.size(), len);
+        return word && index < start + len;
+    }
+#endif
+
+    return cls == class_word;
+}
+
+// Number of words that start at indexes from to to: word bytes
+// that are not preceded by another word byte
+long count_word_starts(std::string_view str, long from, long to)
+{
+    bool previous = from > 0 && is_word_byte(str, from - 1);
+    long count = 0;
+    long i = from;
+
+#ifdef __SSE2__
+    for (; i + 16 <= to; i += 16) {
+        unsigned int high;
+        unsigned int word = word_mask16(str.data() + i, high);
+
+#ifdef MED_UTF8
+        // Blocks with multibyte characters are counted byte by byte
+        if (high) {
+            for (long k = i; k < i + 16; k++) {
+                bool is_word = is_word_byte(str, k);
+                count += is_word && !previous;
+                previous = is_word;
+            }
+
+            continue;
+        }
+#else
+        (void) high;
+#endif
+
+        count += __builtin_popcount(word & ~((word << 1) | (previous ? 1 : 0)));
+        previous = word & (1u << 15);
+    }
+#endif
+
+    for (; i < to; i++) {
+        bool word = is_word_byte(str, i);
+        count += word && !previous;
+        previous = word;
+    }
+
+    return count;
+}
+
+// Number of UTF-8 characters: bytes that are not continuation bytes
+long count_chars(std::string_view str, long from, long to)
+{
+    long count = 0;
+    long i = from;
+
+#ifdef __SSE2__
+    for (; i + 16 <= to; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(str.data() + i));
+
+        // Continuation bytes are 0x80 to 0xBF, which are the
+        // smallest values when bytes are signed
+        count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpgt_epi8(v, _mm_set1_epi8(-65))));
+    }
+#endif
+
+    for (; i < to; i++) {
+        count += (str[i] & 0b1100'0000) != 0b1000'0000;
+    }
+
+    return count;
+}